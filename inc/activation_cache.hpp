@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define ACTIVATION_CACHE_VERSION 1
+
+/// @brief Header at the start of an activation cache file. The hashes tell whether the cache is still valid.
+struct ActivationCacheHeader
+{
+    char magic[8];         // "MNISTHAC"
+    uint32_t version;      // ACTIVATION_CACHE_VERSION
+    int32_t hidden_size;   // Number of activations per image.
+    int32_t n_images;      // Number of images in the cache.
+    uint32_t reserved;
+    uint64_t weights_hash; // Hash of the hidden layer weights and biases that produced the activations.
+    uint64_t dataset_hash; // Hash of the images of the dataset (not the labels, which can change without affecting the activations).
+};
+
+/// @brief Read-only, memory-mapped store of the post-ReLU hidden activations of every image of a dataset.
+///
+/// Activations are stored as bfloat16 (the upper half of a float), which halves the size of the file and is precise enough
+/// to train the output layer on. It is not meant for measuring accuracy: the rounding can flip close predictions, see
+/// `Network::trainHead`. On platforms without mmap, the file is read into memory instead.
+class ActivationCache
+{
+private:
+    void *mapping;                  // Mapped file, or null.
+    size_t mappedBytes;             // Size of the mapping.
+    std::vector<uint16_t> fallback; // Activations read into memory when the file cannot be mapped.
+    const uint16_t *activations;    // hidden_size values per image, image after image.
+
+    void close();
+
+public:
+    int hidden_size, n_images;
+
+    ActivationCache();
+    ~ActivationCache();
+    ActivationCache(const ActivationCache &) = delete;
+    ActivationCache &operator=(const ActivationCache &) = delete;
+
+    /// @brief Map a cache file if it exists and was built from the given weights and dataset.
+    /// @param filename Path of the cache file.
+    /// @param hiddenSize Expected number of activations per image.
+    /// @param nImages Expected number of images.
+    /// @param weightsHash Hash of the current hidden layer (see `Network::hidden_checksum`).
+    /// @param datasetHash Hash of the current dataset (see `ActivationCache::dataset_hash`).
+    /// @return False if the file is missing, unreadable or stale; the cache is then empty.
+    bool open(const std::string &filename, int hiddenSize, int nImages, uint64_t weightsHash, uint64_t datasetHash);
+
+    /// @brief Write a cache file.
+    /// @param filename Path of the cache file.
+    /// @param header Header of the file (magic and version are filled in).
+    /// @param activations `n_images * hidden_size` activations, image after image.
+    static void write(const std::string &filename, ActivationCacheHeader header, const std::vector<float> &activations);
+
+    /// @brief Hash of the images of a dataset (FNV-1a, see `fnv1a_hash`).
+    static uint64_t dataset_hash(const std::vector<unsigned char> &images);
+
+    /// @brief Copy the activations of one image into `output` (hidden_size values).
+    void get(int image, std::vector<float> &output);
+};
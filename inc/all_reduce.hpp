@@ -0,0 +1,114 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#define ALLREDUCE_MAX_RANKS 64
+
+/// @brief Timings and final weights checksum reported by each rank of a data-parallel run.
+struct RankReport
+{
+    double train_seconds; // Time spent in the training steps (computing gradients and exchanging them).
+    double comm_seconds;  // Part of train_seconds spent in the all-reduce.
+    uint64_t checksum;    // Hash of the parameters after training, equal on all ranks when they stayed in sync.
+};
+
+/// @brief Control block at the start of the memory shared by the ranks, followed by one gradient buffer per rank.
+/// Only lock-free atomics are used, so it works both between threads and between processes mapping the same memory.
+struct AllReduceSegment
+{
+    std::atomic<int> arrived;    // Number of ranks waiting at the current barrier.
+    std::atomic<int> generation; // Incremented each time all the ranks passed the barrier.
+    std::atomic<int> aborted;    // Set when a rank failed: the others stop waiting at the barrier.
+    int ranks;
+    size_t count;
+    RankReport reports[ALLREDUCE_MAX_RANKS];
+};
+
+/// @brief Memory region holding an `AllReduceSegment` and the gradient buffers.
+///
+/// With `processShared`, the region is a POSIX shared memory object (shm_open + mmap) that stays mapped in the processes
+/// forked afterwards. Otherwise it is ordinary memory of this process, the stand-in transport used when the ranks are
+/// threads (and the only one available on platforms without POSIX shared memory).
+class SharedRegion
+{
+private:
+    void *memory;
+    size_t bytes;
+    bool processShared;
+
+public:
+    SharedRegion(size_t bytes, bool processShared);
+    ~SharedRegion();
+    SharedRegion(const SharedRegion &) = delete;
+    SharedRegion &operator=(const SharedRegion &) = delete;
+
+    void *data() { return this->memory; }
+    size_t size() { return this->bytes; }
+
+    /// @brief Whether POSIX shared memory and fork() are available on this platform.
+    static bool processes_supported();
+};
+
+/// @brief Ring all-reduce over buffers in shared memory, as seen from one rank.
+///
+/// The vector is split into one chunk per rank. In the reduce-scatter phase, each rank adds the chunk of its left neighbour
+/// into its own buffer, one chunk per step, until every chunk is fully summed on one rank. In the all-gather phase the summed
+/// chunks are copied around the ring. Every chunk is summed in the same order and then copied, so all the ranks end up with
+/// bit-identical results.
+class RingAllReduce
+{
+private:
+    AllReduceSegment *segment;
+    float *buffers;
+    int rank, ranks;
+    size_t count;
+
+    float *buffer(int r) { return this->buffers + (size_t)r * this->count; }
+    size_t chunkBegin(int c, size_t n) { return (size_t)c * n / this->ranks; }
+
+public:
+    /// @param memory Shared memory of at least `segment_size(ranks, count)` bytes, initialized with `init_segment`.
+    /// @param rank Index of this rank, in [0, ranks).
+    /// @param ranks Number of ranks.
+    /// @param count Maximum number of floats in the vectors to reduce.
+    RingAllReduce(void *memory, int rank, int ranks, size_t count);
+
+    /// @brief Size in bytes of the shared memory needed by `ranks` ranks reducing vectors of `count` floats.
+    static size_t segment_size(int ranks, size_t count);
+
+    /// @brief Initialize the control block, once, before the ranks start.
+    static void init_segment(void *memory, int ranks, size_t count);
+
+    /// @brief Mark the run as failed: the ranks waiting at a barrier, or reaching one later, throw instead of waiting
+    /// forever for a rank that will never arrive.
+    static void abort(void *memory);
+
+    int get_rank() { return this->rank; }
+    int get_ranks() { return this->ranks; }
+
+    /// @brief Wait until all the ranks reached the barrier.
+    /// @throws std::runtime_error if the run was aborted because a rank failed.
+    void barrier();
+
+    /// @brief Replace `values` (at most count floats, the same number on every rank) by its sum over all the ranks.
+    void all_reduce(std::vector<float> &values);
+
+    /// @brief Replace `values` (at most count floats, the same number on every rank) by the values of rank `root`.
+    void broadcast(std::vector<float> &values, int root);
+
+    /// @brief Report area of a rank, readable by every rank (and by the launcher once the ranks are done).
+    RankReport &report(int r) { return this->segment->reports[r]; }
+};
+
+/// @brief Runs `work(rank)` for every rank, either in forked child processes or in threads of this process, and waits for all of them.
+/// As soon as a rank fails (throws, or its process exits with an error or is killed), the run is aborted with
+/// `RingAllReduce::abort` so that the other ranks do not wait for it forever.
+/// @param ranks Number of ranks.
+/// @param processes Fork one process per rank (requires `SharedRegion::processes_supported()`), otherwise use threads.
+/// @param memory Shared memory of the run, initialized with `RingAllReduce::init_segment`.
+/// @param work The function executed by each rank.
+/// @return False if a rank failed.
+bool run_ranks(int ranks, bool processes, void *memory, const std::function<void(int)> &work);
@@ -0,0 +1,20 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#define FNV1A_OFFSET_BASIS 14695981039346656037ull
+#define FNV1A_PRIME 1099511628211ull
+
+/// @brief 64 bit FNV-1a hash of a block of memory.
+/// @param data The bytes to hash.
+/// @param bytes Number of bytes.
+/// @param hash Hash to continue from, to hash several blocks as one.
+inline uint64_t fnv1a_hash(const void *data, size_t bytes, uint64_t hash = FNV1A_OFFSET_BASIS)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < bytes; i++)
+    {
+        hash = (hash ^ p[i]) * FNV1A_PRIME;
+    }
+    return hash;
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include <math.h>
+#include <algorithm>
 #include <cstdlib>
+#include <random>
 #include <vector>
 #include <iostream>
 
@@ -11,13 +13,44 @@ class Layer
 public:
     std::vector<float> weights;  // A flattened array representing the weight matrix.
     std::vector<float> biases;   // An array for the biases of each neuron.
-    int input_size, output_size; // Input and output size of a layer
+    std::vector<unsigned char> mask; // Pruning mask (1 = connection kept, 0 = pruned). Empty while the layer is dense.
+    int input_size, output_size;     // Input and output size of a layer
+
+    // Read-only weights and biases stored outside the layer (e.g. embedded in the executable), used instead of `weights` and
+    // `biases` (which are then empty) until the layer is modified. Null when the layer owns its parameters.
+    const float *shared_weights;
+    const float *shared_biases;
 
     /// @brief Initialize the layer and its weights and biases
     /// @param in_size Input size of the layer
     /// @param out_size Output size of the layer
     Layer(int in_size, int out_size);
 
+    /// @brief Same as above, but the weights are drawn from `rng` instead of the global `rand()`, so that layers can be
+    /// created concurrently and reproducibly.
+    /// @param in_size Input size of the layer
+    /// @param out_size Output size of the layer
+    /// @param rng Random number generator used for the initial weights
+    Layer(int in_size, int out_size, std::mt19937 &rng);
+
+    /// @brief Create a layer that reads its parameters from read-only arrays it does not own, without copying them.
+    /// They are copied into `weights` and `biases` only if the layer is trained or pruned (see `make_owned`).
+    /// @param in_size Input size of the layer
+    /// @param out_size Output size of the layer
+    /// @param weights in_size * out_size weights, with the same layout as `weights`, that outlive the layer
+    /// @param biases out_size biases that outlive the layer
+    Layer(int in_size, int out_size, const float *weights, const float *biases);
+
+    /// @brief The weights of the layer, shared or owned.
+    const float *weight_data() const { return this->shared_weights != nullptr ? this->shared_weights : this->weights.data(); }
+
+    /// @brief The biases of the layer, shared or owned.
+    const float *bias_data() const { return this->shared_biases != nullptr ? this->shared_biases : this->biases.data(); }
+
+    /// @brief Copy shared parameters into `weights` and `biases`, so that they can be modified. Does nothing if the layer
+    /// already owns them.
+    void make_owned();
+
     /// @brief Forward pass: The process of computing the output of a layer in a neural network given the input.
     /// It computes the weighted sum of inputs for each neuron and adds the bias to get the output.
     ///
@@ -34,4 +67,30 @@ public:
     ///        If null, it means we do not need to compute gradients for the input (i.e., for the first layer).
     /// @param lr Learning rate, a scalar value that controls how much we adjust the weights and biases based on the gradients.
     void backward(std::vector<float> &input, std::vector<float> &output_grad, std::vector<float> &input_grad, float lr);
+
+    /// @brief Backward pass for data-parallel training: same gradients as `backward`, but they are added to `weight_grad` and
+    /// `bias_grad` instead of being applied to the weights, so that they can be summed over several samples and processes first.
+    ///
+    /// @param input Pointer to the input data (the same input used during the forward pass).
+    /// @param output_grad Pointer to the gradient of the loss with respect to the output.
+    /// @param input_grad Pointer to store the gradient of the loss with respect to the input, or empty if not needed.
+    /// @param weight_grad Gradient accumulator for the weights (input_size * output_size values, same layout as `weights`).
+    /// @param bias_grad Gradient accumulator for the biases (output_size values).
+    void accumulate_gradients(std::vector<float> &input, std::vector<float> &output_grad, std::vector<float> &input_grad,
+                              float *weight_grad, float *bias_grad);
+
+    /// @brief Update the weights and biases with gradients collected by `accumulate_gradients`. Pruned weights stay at zero.
+    /// @param weight_grad Gradient of the weights (same layout as `weights`).
+    /// @param bias_grad Gradient of the biases.
+    /// @param lr Learning rate.
+    void apply_gradients(const float *weight_grad, const float *bias_grad, float lr);
+
+    /// @brief Magnitude pruning: zero out the weights with the smallest absolute value until the requested fraction of the
+    /// weights is zero. The pruned connections are recorded in `mask`, so that further training (fine-tuning) keeps them at zero.
+    ///
+    /// @param sparsity Fraction of the weights to remove, in [0, 1). Pruning again with a higher value prunes further.
+    void prune(float sparsity);
+
+    /// @brief Fraction of the weights of the layer that are exactly zero.
+    float sparsity();
 };
\ No newline at end of file
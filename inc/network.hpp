@@ -1,5 +1,8 @@
 #pragma once
 #include <layer.hpp>
+#include "sparse_layer.hpp"
+#include "all_reduce.hpp"
+#include "activation_cache.hpp"
 #include "input_data.hpp"
 
 #define HIDDEN_SIZE 256
@@ -11,6 +14,10 @@ private:
     Layer *hidden;
     Layer *output; // MNIST Neural Network
 
+    int hidden_size;  // Number of neurons in the hidden layer.
+
+    SparseLayer *sparse_hidden; // CSR copy of the hidden layer used by the sparse inference path (null until compiled).
+
     void softmax(std::vector<float> &input, int size);
 
     /// @brief Train the network on a single Aexample, performing a forward pass followed by a backward pass.
@@ -20,8 +27,28 @@ private:
     /// @param lr Learning rate, which controls how much to adjust the weights and biases based on the gradients.
     void trainSingle(std::vector<float> &input, int label, float lr);
 
+    /// @brief Forward and backward pass on a single example, adding the gradients to `grad` instead of updating the weights.
+    /// @param input The input data for this training example.
+    /// @param label The correct label (class) for this training example.
+    /// @param grad Gradient accumulator with the layout of `get_parameters`.
+    /// @return The loss of the example before the update.
+    float accumulateSingle(std::vector<float> &input, int label, std::vector<float> &grad);
+
+    /// @brief Second half of the prediction: ReLU on the hidden layer output, then output layer, softmax and argmax.
+    /// @param hidden_output The raw output of the hidden layer (modified in place by the ReLU).
+    /// @return The index of the class with the highest probability.
+    int predictFromHidden(std::vector<float> &hidden_output);
+
 public:
-    Network();
+    /// @brief Create a network with randomly initialized weights.
+    /// @param hiddenSize Number of neurons in the hidden layer.
+    Network(int hiddenSize = HIDDEN_SIZE);
+
+    /// @brief Create a network whose initial weights only depend on `seed`. Unlike the constructor above, it does not use
+    /// the global `rand()`, so several networks can be created concurrently.
+    /// @param hiddenSize Number of neurons in the hidden layer.
+    /// @param seed Seed of the random number generator used for the initial weights.
+    Network(int hiddenSize, unsigned seed);
     ~Network();
 
     /// @brief Perform prediction using the neural network by performing a forward pass and returning the class with the highest probability.
@@ -37,6 +64,130 @@ public:
     /// @param filename The file path from where the network will be loaded.
     void load_network(std::string filename);
 
+    /// @brief Whether a trained network was compiled into the executable (CMake option `MNIST_EMBED_MODEL`).
+    static bool has_embedded_network();
+
+    /// @brief Loads the network compiled into the executable, without any file I/O or parsing.
+    /// The layers read the weights in place, without copying them until the network is trained or pruned.
+    /// The hidden layer size becomes the one of the embedded network. Exits if no network was embedded.
+    void load_embedded_network();
+
+    /// @brief Prune the hidden layer by weight magnitude (see `Layer::prune`) and drop any previously compiled sparse layer.
+    /// Calling `trainNetwork` afterwards fine-tunes the remaining weights while the pruned ones stay at zero.
+    /// @param sparsity Fraction of the hidden layer weights to remove, in [0, 1).
+    void prune(float sparsity);
+
+    /// @brief Build the CSR (sparse) copy of the hidden layer from its current weights. Must be called again after training.
+    void compile_sparse();
+
+    /// @brief Same as `predict`, but the hidden layer goes through the sparse kernel, skipping pruned weights and zero pixels.
+    /// @param input Pointer to the input data for which we want to predict the class.
+    /// @param skipZeroInputs Also skip zero pixels (see `SparseLayer::forward`).
+    /// @return The index of the class (label) with the highest probability.
+    int predict_sparse(std::vector<float> &input, bool skipZeroInputs = true);
+
+    /// @brief Batched version of `predict_sparse`, using the sparse GEMM kernel for the hidden layer.
+    /// @param inputs `batchSize` input images stored one after the other.
+    /// @param batchSize Number of images in the batch.
+    /// @param predictions Receives the predicted class of each image.
+    void predict_sparse_batch(const std::vector<float> &inputs, int batchSize, std::vector<int> &predictions);
+
+    /// @brief Saves the network with the hidden layer in CSR format followed by the dense output layer.
+    /// @param filename The file path where the network will be saved.
+    /// @return The size of the written file in bytes.
+    size_t save_sparse_network(std::string filename);
+
+    /// @brief Loads a network written by `save_sparse_network`. The dense hidden layer is rebuilt from the CSR weights.
+    /// @param filename The file path from where the network will be loaded.
+    void load_sparse_network(std::string filename);
+
+    /// @brief Computes the accuracy of the network on a range of images of the dataset.
+    /// @param data The dataset object containing the images and labels.
+    /// @param begin Index of the first image to evaluate.
+    /// @param end One past the index of the last image to evaluate.
+    /// @param sparse Use the sparse inference path (`predict_sparse`) instead of the dense one.
+    /// @return The fraction of correctly classified images.
+    float evaluate(InputData &data, int begin, int end, bool sparse = false);
+
+    /// @brief Runs a single training epoch over the first `trainSize` images of the dataset.
+    /// The dataset is only read, so several networks can train on the same `InputData` at the same time.
+    /// @param data The dataset object containing the training images and labels.
+    /// @param learning_rate The learning rate used to update the weights and biases during training.
+    /// @param trainSize Number of images (from the start of the dataset) to train on.
+    /// @param batchSize The number of samples to process before updating the network’s weights (batch size).
+    /// @return The average loss over the epoch.
+    float trainEpoch(InputData &data, float learning_rate, int trainSize, int batchSize);
+
+    /// @brief Number of trainable parameters (weights and biases of both layers).
+    int parameter_count();
+
+    /// @brief Copies all the parameters into one vector, in the order of the saved file:
+    /// hidden weights, hidden biases, output weights, output biases.
+    void get_parameters(std::vector<float> &parameters);
+
+    /// @brief Replaces all the parameters by a vector laid out as in `get_parameters`.
+    void set_parameters(const std::vector<float> &parameters);
+
+    /// @brief 64 bit FNV-1a hash of the parameters, to check that several copies of the network are bit-identical.
+    uint64_t checksum();
+
+    /// @brief One rank of data-parallel training. Every rank runs this function with its own network and the same arguments.
+    ///
+    /// The training set is split into one contiguous shard per rank. At each step, every rank computes the gradients of
+    /// `batchSize / ranks` samples of its shard, the gradients are summed over the ranks with `comm.all_reduce`, and every
+    /// rank applies the same sum. The sum (not the mean) is applied so that the step size matches the per-sample updates of
+    /// `trainNetwork`. The parameters are first broadcast from rank 0, so the networks stay bit-identical on all the ranks.
+    /// Rank 0 prints the accuracy after each epoch, and the average loss of the samples before the step that used them
+    /// (unlike `trainNetwork`, which reports it after the update, so the two are labelled differently). The timings and
+    /// final checksum of each rank go to `comm.report(rank)`.
+    ///
+    /// @param data The dataset object containing the training images and labels.
+    /// @param learning_rate The learning rate used to update the weights and biases during training.
+    /// @param trainSplit A float value representing the fraction of data to be used for training.
+    /// @param epochs The number of times the training process iterates over the training dataset.
+    /// @param batchSize The global batch size, summed over all the ranks.
+    /// @param comm The all-reduce transport connecting the ranks.
+    void trainDataParallel(InputData &data,
+                           float learning_rate,
+                           float trainSplit,
+                           int epochs,
+                           int batchSize,
+                           RingAllReduce &comm);
+
+    /// @brief Hash of the hidden layer weights and biases, used to detect stale activation caches.
+    uint64_t hidden_checksum();
+
+    /// @brief Re-initializes the output layer with random weights, e.g. before training it on a new label set.
+    void reset_output_layer();
+
+    /// @brief Computes the post-ReLU hidden activations of every image of the dataset and writes them to a cache file.
+    /// @param data The dataset object containing the images.
+    /// @param cacheFile Path of the cache file to write.
+    /// @param datasetHash `ActivationCache::dataset_hash(data.images)`, stored in the cache header.
+    void build_activation_cache(InputData &data, std::string cacheFile, uint64_t datasetHash);
+
+    /// @brief Fine-tunes the output layer only, with the hidden layer frozen.
+    ///
+    /// The hidden activations are read from `cacheFile`, which is (re)built first if it is missing or was computed with other
+    /// hidden weights or images. Each step then only costs the small output layer instead of the full 784 x hidden product.
+    /// The cache holds bfloat16 values, so only the training reads it: the test split is evaluated on full precision
+    /// activations, computed once per call, and the printed accuracy is the one `predict` gets.
+    ///
+    /// @param data The dataset object containing the training images and labels.
+    /// @param cacheFile Path of the activation cache file.
+    /// @param learning_rate The learning rate used to update the output layer.
+    /// @param trainSplit A float value representing the fraction of data to be used for training.
+    /// @param epochs The number of times the training process iterates over the training dataset.
+    /// @param batchSize The number of samples to process before updating the network’s weights (batch size).
+    /// @param datasetHash `ActivationCache::dataset_hash(data.images)`, computed once by the caller rather than on every call.
+    void trainHead(InputData &data,
+                   std::string cacheFile,
+                   float learning_rate,
+                   float trainSplit,
+                   int epochs,
+                   int batchSize,
+                   uint64_t datasetHash);
+
     /// @brief Trains the neural network on the provided dataset over multiple epochs using stochastic gradient descent.
     ///
     /// This function handles the main training loop of the neural network. It divides the dataset into training and test sets
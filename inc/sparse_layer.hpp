@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include "layer.hpp"
+
+/// @brief Inference-only copy of a (pruned) `Layer`, stored in CSR (Compressed Sparse Row) format.
+///
+/// The rows of the CSR matrix are the inputs of the layer, matching the `j * output_size + i` layout of `Layer::weights`:
+/// row j lists the outputs i that input j is still connected to after pruning. The forward pass walks only these
+/// connections, and skips whole rows whose input is zero (most pixels of an MNIST image are black).
+class SparseLayer
+{
+public:
+    std::vector<int> row_ptr;       // row_ptr[j]..row_ptr[j + 1] is the range of input j in col_idx and values.
+    std::vector<uint16_t> col_idx;  // Output index of each non-zero weight.
+    std::vector<float> values;      // The non-zero weights.
+    std::vector<float> biases;      // An array for the biases of each neuron.
+    int input_size, output_size;    // Input and output size of a layer
+
+    SparseLayer();
+
+    /// @brief Build the CSR representation of a dense layer, keeping only its non-zero weights.
+    /// @param layer The (usually pruned) layer to convert.
+    SparseLayer(const Layer &layer);
+
+    /// @brief Sparse GEMV forward pass, computing the same output as `Layer::forward` on the non-zero weights.
+    /// @param input The input data (from the previous layer or input layer in the network).
+    /// @param output The array that will hold the computed output of the current layer.
+    /// @param skipZeroInputs Skip the rows of zero inputs. Disabling it walks every non-zero weight, which isolates the
+    /// gain of weight sparsity from the gain of input sparsity when benchmarking.
+    void forward(std::vector<float> &input, std::vector<float> &output, bool skipZeroInputs = true);
+
+    /// @brief Sparse GEMM forward pass over a batch of inputs. Each CSR row is loaded once for the whole batch.
+    /// @param inputs `batchSize` inputs stored one after the other (batchSize * input_size values).
+    /// @param outputs Receives `batchSize` outputs stored one after the other (batchSize * output_size values).
+    /// @param batchSize Number of samples in the batch.
+    void forward_batch(const std::vector<float> &inputs, std::vector<float> &outputs, int batchSize);
+
+    /// @brief Number of non-zero weights stored in the layer.
+    int nnz();
+
+    /// @brief Size of the layer in bytes once written with `save`.
+    size_t size_in_bytes();
+
+    /// @brief Write the layer to an already opened binary file.
+    void save(std::ofstream &file);
+
+    /// @brief Read a layer written by `save` from an already opened binary file, checking that it is a well-formed CSR matrix.
+    /// @param file The file to read from.
+    /// @param in_size Expected input size of the layer.
+    /// @param out_size Expected output size of the layer.
+    /// @return False if the file is truncated, has other sizes, or holds inconsistent CSR data.
+    bool load(std::ifstream &file, int in_size, int out_size);
+};
@@ -0,0 +1,100 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <ostream>
+#include "network.hpp"
+
+/// @brief One set of hyperparameters to train a network with.
+struct SweepConfig
+{
+    float learning_rate;
+    int batch_size;
+    int hidden_size;
+    int epochs;
+};
+
+/// @brief Outcome of training one `SweepConfig`.
+struct SweepResult
+{
+    SweepConfig config;
+    std::vector<float> accuracy; // Test accuracy after each epoch that was run.
+    float loss;                  // Average training loss of the last epoch that was run.
+    double seconds;              // Wall time spent training and evaluating this configuration.
+    bool stopped_early;          // True if the run was terminated because it fell behind the other runs.
+};
+
+/// @brief Search space of a hyperparameter sweep, either a full grid or a random search over it.
+///
+/// The specification is a list of `key=value[,value...]` entries separated by spaces or ';', for example
+/// `lr=0.001,0.01 batch=32,64 hidden=128,256 epochs=5`. Recognised keys:
+///   - `lr`, `batch`, `hidden`, `epochs`: values of each hyperparameter. In random mode, `lr` also accepts a
+///     `min:max` range which is sampled log-uniformly.
+///   - `random=N`: draw N random configurations instead of the full grid.
+///   - `seed=S`: seed of the random draw and of the initial weights of every run (default 1), making the sweep reproducible.
+///   - `threads=N`: number of worker threads (default: number of cores this process may run on).
+///   - `pin=0|1`: pin each worker thread to its own core, within the process CPU mask (Linux only, default 1).
+///   - `baseline=1`: also run the whole sweep on a single thread, to measure the actual speedup.
+///   - `stop=X`: terminate a run whose accuracy is more than X (e.g. 0.05 = 5 points) below the best run at the same epoch.
+///     The runs are compared once all of them finished the epoch, so the same runs are terminated whatever the thread count.
+class SweepSpec
+{
+public:
+    std::vector<float> learning_rates;
+    std::vector<int> batch_sizes, hidden_sizes, epochs;
+    float lr_min, lr_max; // Log-uniform learning rate range for random search, unused when both are zero.
+
+    int random_samples;
+    unsigned seed;
+    int threads;
+    bool pin_threads;
+    bool baseline;
+    float stop_margin;
+
+    SweepSpec();
+
+    /// @brief Parse a specification string (see the class description). Throws `std::runtime_error` on invalid input.
+    /// @param spec The specification string.
+    /// @param defaults Value used for every hyperparameter that the specification does not list.
+    static SweepSpec parse(const std::string &spec, const SweepConfig &defaults);
+
+    /// @brief The list of configurations to train: the full grid, or `random_samples` random draws from it.
+    std::vector<SweepConfig> configurations();
+};
+
+/// @brief Trains many networks concurrently on a thread pool, all reading the same in-memory dataset.
+class SweepRunner
+{
+private:
+    InputData &data;
+    float trainSplit;
+    int threads;
+    bool pinThreads;
+    float stopMargin;
+    unsigned seed;
+
+public:
+    /// @param data The dataset, loaded once and only read by the workers.
+    /// @param trainSplit Fraction of the dataset used for training, the rest is used to compute the accuracy.
+    /// @param threads Number of worker threads; 0 uses the number of cores this process may run on.
+    /// @param pinThreads Pin each worker thread to its own core (Linux only).
+    /// @param stopMargin Terminate a run whose accuracy falls more than this below the best of all the runs at the same
+    ///                   epoch; 0 disables it. The runs advance in lockstep, one epoch per round, to compare them all.
+    /// @param seed Seed of the initial weights. Every run starts from the weights given by this seed, so runs with the same
+    ///             hidden size start from the same point. Together with the lockstep early termination, the results and
+    ///             the work done do not depend on thread scheduling or on the number of threads.
+    SweepRunner(InputData &data, float trainSplit, int threads, bool pinThreads, float stopMargin, unsigned seed);
+
+    /// @brief Train every configuration and return the results in the same order. All the runs advance one epoch per
+    /// round, so the networks of the active runs are all kept in memory at the same time.
+    /// @param configs The configurations to train.
+    /// @param wallSeconds If not null, receives the wall time of the whole sweep.
+    std::vector<SweepResult> run(const std::vector<SweepConfig> &configs, double *wallSeconds = nullptr);
+
+    /// @brief Print the results as a table sorted by final accuracy, followed by the wall time of the sweep.
+    /// @param results The results returned by `run`.
+    /// @param wallSeconds Wall time of the sweep.
+    /// @param sequentialSeconds Measured wall time of the same sweep on a single thread, or a negative value if it was not
+    ///                          measured. The speedup is only printed when it is known.
+    /// @param out The stream to print to.
+    static void print_summary(std::vector<SweepResult> results, double wallSeconds, double sequentialSeconds, std::ostream &out);
+};
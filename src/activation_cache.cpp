@@ -0,0 +1,155 @@
+#include "activation_cache.hpp"
+#include "hash.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MNIST_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const char ACTIVATION_CACHE_MAGIC[8] = {'M', 'N', 'I', 'S', 'T', 'H', 'A', 'C'};
+
+// float -> bfloat16, rounding to nearest even.
+static uint16_t toBfloat16(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+
+// bfloat16 -> float, exact.
+static float fromBfloat16(uint16_t value)
+{
+    uint32_t bits = (uint32_t)value << 16;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+ActivationCache::ActivationCache()
+{
+    this->mapping = nullptr;
+    this->mappedBytes = 0;
+    this->activations = nullptr;
+    this->hidden_size = 0;
+    this->n_images = 0;
+}
+
+ActivationCache::~ActivationCache()
+{
+    this->close();
+}
+
+void ActivationCache::close()
+{
+#ifdef MNIST_MMAP
+    if (this->mapping != nullptr)
+        munmap(this->mapping, this->mappedBytes);
+#endif
+    this->mapping = nullptr;
+    this->mappedBytes = 0;
+    this->fallback.clear();
+    this->activations = nullptr;
+    this->hidden_size = 0;
+    this->n_images = 0;
+}
+
+bool ActivationCache::open(const std::string &filename, int hiddenSize, int nImages, uint64_t weightsHash, uint64_t datasetHash)
+{
+    this->close();
+
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        return false;
+
+    size_t fileSize = (size_t)file.tellg();
+    size_t dataBytes = (size_t)hiddenSize * nImages * sizeof(uint16_t);
+    ActivationCacheHeader header;
+    file.seekg(0);
+    if (fileSize != sizeof(header) + dataBytes || !file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+        return false;
+
+    // Any change of the hidden layer or of the images makes the cached activations stale.
+    if (memcmp(header.magic, ACTIVATION_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != ACTIVATION_CACHE_VERSION ||
+        header.hidden_size != hiddenSize ||
+        header.n_images != nImages ||
+        header.weights_hash != weightsHash ||
+        header.dataset_hash != datasetHash)
+        return false;
+
+#ifdef MNIST_MMAP
+    file.close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    void *mapped = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+
+    this->mapping = mapped;
+    this->mappedBytes = fileSize;
+    this->activations = reinterpret_cast<const uint16_t *>(static_cast<char *>(mapped) + sizeof(header));
+#else
+    this->fallback.resize((size_t)hiddenSize * nImages);
+    if (!file.read(reinterpret_cast<char *>(this->fallback.data()), dataBytes))
+    {
+        this->fallback.clear();
+        return false;
+    }
+    this->activations = this->fallback.data();
+#endif
+
+    this->hidden_size = hiddenSize;
+    this->n_images = nImages;
+    return true;
+}
+
+void ActivationCache::write(const std::string &filename, ActivationCacheHeader header, const std::vector<float> &activations)
+{
+    memcpy(header.magic, ACTIVATION_CACHE_MAGIC, sizeof(header.magic));
+    header.version = ACTIVATION_CACHE_VERSION;
+    header.reserved = 0;
+
+    std::vector<uint16_t> compact(activations.size());
+    for (size_t i = 0; i < activations.size(); i++)
+    {
+        compact[i] = toBfloat16(activations[i]);
+    }
+
+    // Write to a temporary file first, so that an interrupted write never leaves a truncated cache behind.
+    std::string tmpName = filename + ".tmp";
+    std::ofstream file(tmpName, std::ios::binary);
+    if (!file.is_open())
+        throw std::runtime_error("Error opening file to write activation cache: " + tmpName);
+    file.write(reinterpret_cast<char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<char *>(compact.data()), compact.size() * sizeof(uint16_t));
+    file.close();
+    if (!file)
+        throw std::runtime_error("Error writing activation cache: " + tmpName);
+
+    std::remove(filename.c_str());
+    if (std::rename(tmpName.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("Error renaming activation cache to " + filename);
+}
+
+uint64_t ActivationCache::dataset_hash(const std::vector<unsigned char> &images)
+{
+    return fnv1a_hash(images.data(), images.size());
+}
+
+void ActivationCache::get(int image, std::vector<float> &output)
+{
+    const uint16_t *row = this->activations + (size_t)image * this->hidden_size;
+    for (int i = 0; i < this->hidden_size; i++)
+    {
+        output[i] = fromBfloat16(row[i]);
+    }
+}
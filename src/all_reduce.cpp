@@ -0,0 +1,291 @@
+#include "all_reduce.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MNIST_POSIX_SHM
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+static_assert(std::atomic<int>::is_always_lock_free, "The all-reduce barrier needs lock-free atomics to work across processes");
+
+SharedRegion::SharedRegion(size_t bytes, bool processShared)
+{
+    this->bytes = bytes;
+    this->processShared = processShared;
+
+    if (!processShared)
+    {
+        this->memory = ::operator new(bytes, std::align_val_t(64));
+        return;
+    }
+
+#ifdef MNIST_POSIX_SHM
+    // Unique name per process; the name is removed right away, the mapping (inherited by fork) keeps the memory alive.
+    std::string name = "/mnist_allreduce_" + std::to_string(getpid());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        throw std::runtime_error("shm_open failed for " + name);
+    shm_unlink(name.c_str());
+
+    if (ftruncate(fd, bytes) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("ftruncate failed on shared memory " + name);
+    }
+
+    this->memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (this->memory == MAP_FAILED)
+        throw std::runtime_error("mmap failed on shared memory " + name);
+#else
+    throw std::runtime_error("POSIX shared memory is not available on this platform");
+#endif
+}
+
+SharedRegion::~SharedRegion()
+{
+    if (!this->processShared)
+    {
+        ::operator delete(this->memory, std::align_val_t(64));
+        return;
+    }
+
+#ifdef MNIST_POSIX_SHM
+    munmap(this->memory, this->bytes);
+#endif
+}
+
+bool SharedRegion::processes_supported()
+{
+#ifdef MNIST_POSIX_SHM
+    return true;
+#else
+    return false;
+#endif
+}
+
+size_t RingAllReduce::segment_size(int ranks, size_t count)
+{
+    // Buffers start on a cache line boundary after the control block.
+    size_t header = (sizeof(AllReduceSegment) + 63) / 64 * 64;
+    return header + (size_t)ranks * count * sizeof(float);
+}
+
+void RingAllReduce::init_segment(void *memory, int ranks, size_t count)
+{
+    if (ranks < 1 || ranks > ALLREDUCE_MAX_RANKS)
+        throw std::runtime_error("Unsupported number of ranks: " + std::to_string(ranks));
+
+    AllReduceSegment *segment = new (memory) AllReduceSegment();
+    segment->arrived.store(0);
+    segment->generation.store(0);
+    segment->aborted.store(0);
+    segment->ranks = ranks;
+    segment->count = count;
+    memset(segment->reports, 0, sizeof(segment->reports));
+}
+
+void RingAllReduce::abort(void *memory)
+{
+    static_cast<AllReduceSegment *>(memory)->aborted.store(1, std::memory_order_release);
+}
+
+RingAllReduce::RingAllReduce(void *memory, int rank, int ranks, size_t count)
+{
+    this->segment = static_cast<AllReduceSegment *>(memory);
+    this->buffers = reinterpret_cast<float *>(static_cast<char *>(memory) + (sizeof(AllReduceSegment) + 63) / 64 * 64);
+    this->rank = rank;
+    this->ranks = ranks;
+    this->count = count;
+
+    if (this->segment->ranks != ranks || this->segment->count != count)
+        throw std::runtime_error("Shared memory segment does not match the all-reduce configuration");
+}
+
+void RingAllReduce::barrier()
+{
+    // Sense-reversing barrier: the last rank to arrive resets the counter and starts a new generation.
+    int generation = this->segment->generation.load(std::memory_order_acquire);
+    if (this->segment->arrived.fetch_add(1, std::memory_order_acq_rel) == this->ranks - 1)
+    {
+        this->segment->arrived.store(0, std::memory_order_relaxed);
+        this->segment->generation.fetch_add(1, std::memory_order_release);
+        return;
+    }
+
+    while (this->segment->generation.load(std::memory_order_acquire) == generation)
+    {
+        if (this->segment->aborted.load(std::memory_order_acquire))
+            throw std::runtime_error("all-reduce aborted: another rank failed");
+        std::this_thread::yield();
+    }
+}
+
+void RingAllReduce::all_reduce(std::vector<float> &values)
+{
+    size_t n = values.size();
+    if (n > this->count)
+        throw std::runtime_error("all_reduce: vector larger than the shared buffers");
+
+    float *own = this->buffer(this->rank);
+    const float *left = this->buffer((this->rank + this->ranks - 1) % this->ranks);
+
+    memcpy(own, values.data(), n * sizeof(float));
+    this->barrier();
+
+    // Reduce-scatter: at step s, add chunk (rank - s - 1) of the left neighbour into our own buffer. The left neighbour is
+    // meanwhile writing chunk (rank - s - 2), so reads and writes never touch the same chunk. After ranks - 1 steps,
+    // chunk (rank + 1) holds the sum over all the ranks.
+    for (int s = 0; s < this->ranks - 1; s++)
+    {
+        int c = ((this->rank - s - 1) % this->ranks + this->ranks) % this->ranks;
+        for (size_t k = this->chunkBegin(c, n); k < this->chunkBegin(c + 1, n); k++)
+        {
+            own[k] += left[k];
+        }
+        this->barrier();
+    }
+
+    // All-gather: at step s, copy the summed chunk (rank - s) from the left neighbour.
+    for (int s = 0; s < this->ranks - 1; s++)
+    {
+        int c = ((this->rank - s) % this->ranks + this->ranks) % this->ranks;
+        size_t begin = this->chunkBegin(c, n), end = this->chunkBegin(c + 1, n);
+        memcpy(own + begin, left + begin, (end - begin) * sizeof(float));
+        this->barrier();
+    }
+
+    memcpy(values.data(), own, n * sizeof(float));
+}
+
+void RingAllReduce::broadcast(std::vector<float> &values, int root)
+{
+    size_t n = values.size();
+    if (n > this->count)
+        throw std::runtime_error("broadcast: vector larger than the shared buffers");
+
+    if (this->rank == root)
+        memcpy(this->buffer(root), values.data(), n * sizeof(float));
+    this->barrier();
+
+    if (this->rank != root)
+        memcpy(values.data(), this->buffer(root), n * sizeof(float));
+    this->barrier();
+}
+
+bool run_ranks(int ranks, bool processes, void *memory, const std::function<void(int)> &work)
+{
+    if (!processes)
+    {
+        std::atomic<bool> ok(true);
+        std::vector<std::thread> threads;
+        for (int r = 0; r < ranks; r++)
+        {
+            threads.emplace_back([&, r]()
+                                 {
+                                     try
+                                     {
+                                         work(r);
+                                     }
+                                     catch (const std::exception &e)
+                                     {
+                                         fprintf(stderr, "Rank %d failed: %s\n", r, e.what());
+                                         ok = false;
+                                         RingAllReduce::abort(memory);
+                                     } });
+        }
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+        return ok;
+    }
+
+#ifdef MNIST_POSIX_SHM
+    // Buffered output would otherwise be written again by every child.
+    fflush(stdout);
+    fflush(stderr);
+
+    bool ok = true;
+    std::vector<pid_t> running;
+    for (int r = 0; r < ranks; r++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            // The ranks already started would wait for this one forever: abort them, and reap them below.
+            perror("fork");
+            RingAllReduce::abort(memory);
+            ok = false;
+            break;
+        }
+        if (pid == 0)
+        {
+            int code = 0;
+            try
+            {
+                work(r);
+            }
+            catch (const std::exception &e)
+            {
+                fprintf(stderr, "Rank %d failed: %s\n", r, e.what());
+                code = 1;
+            }
+            fflush(stdout);
+            fflush(stderr);
+            _exit(code);
+        }
+        running.push_back(pid);
+    }
+
+    // Reap the children in the order they finish, so that the first failure aborts the others right away.
+    while (!running.empty())
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // Cannot tell which children are done: abort the run and wait for each remaining child in turn.
+            perror("waitpid");
+            RingAllReduce::abort(memory);
+            ok = false;
+            for (pid_t child : running)
+            {
+                while (waitpid(child, &status, 0) < 0 && errno == EINTR)
+                {
+                }
+            }
+            break;
+        }
+
+        auto it = std::find(running.begin(), running.end(), pid);
+        if (it == running.end())
+            continue;
+        running.erase(it);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            if (ok)
+                RingAllReduce::abort(memory);
+            ok = false;
+        }
+    }
+    return ok;
+#else
+    throw std::runtime_error("Multi-process training is not available on this platform");
+#endif
+}
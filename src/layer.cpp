@@ -9,6 +9,8 @@ Layer::Layer(int in_size, int out_size)
     this->output_size = out_size;
     this->weights = std::vector<float>(n);
     this->biases = std::vector<float>(out_size, 0.f);
+    this->shared_weights = nullptr;
+    this->shared_biases = nullptr;
 
     // We use 'He Initialization' to set the weights.
     for (int i = 0; i < n; i++)
@@ -17,14 +19,55 @@ Layer::Layer(int in_size, int out_size)
     }
 }
 
+Layer::Layer(int in_size, int out_size, std::mt19937 &rng)
+{
+    int n = in_size * out_size;
+    float scale = sqrtf(2.0f / in_size);
+
+    this->input_size = in_size;
+    this->output_size = out_size;
+    this->weights = std::vector<float>(n);
+    this->biases = std::vector<float>(out_size, 0.f);
+    this->shared_weights = nullptr;
+    this->shared_biases = nullptr;
+
+    // Same 'He Initialization' range as above.
+    std::uniform_real_distribution<float> distribution(-scale, scale);
+    for (int i = 0; i < n; i++)
+    {
+        this->weights[i] = distribution(rng);
+    }
+}
+
+Layer::Layer(int in_size, int out_size, const float *weights, const float *biases)
+{
+    this->input_size = in_size;
+    this->output_size = out_size;
+    this->shared_weights = weights;
+    this->shared_biases = biases;
+}
+
+void Layer::make_owned()
+{
+    if (this->shared_weights == nullptr)
+        return;
+
+    this->weights.assign(this->shared_weights, this->shared_weights + this->input_size * this->output_size);
+    this->biases.assign(this->shared_biases, this->shared_biases + this->output_size);
+    this->shared_weights = nullptr;
+    this->shared_biases = nullptr;
+}
+
 void Layer::forward(std::vector<float> &input, std::vector<float> &output)
 {
+    const float *weights = this->weight_data(), *biases = this->bias_data();
+
     // Loop over each output node (neuron) in the layer (i.e., for each neuron in this layer).
     for (int i = 0; i < this->output_size; i++)
     {
         // Start by setting the output to the bias of the current neuron.
         // Each neuron has its own bias term that is independent of the input.
-        output[i] = this->biases[i];
+        output[i] = biases[i];
 
         // Loop over each input coming from the previous layer.
         for (int j = 0; j < this->input_size; j++)
@@ -32,13 +75,15 @@ void Layer::forward(std::vector<float> &input, std::vector<float> &output)
             // Calculate the contribution of the current input to the output of the neuron.
             // The weight corresponding to the connection between input j and output i is located at index (j * output_size + i).
             // Multiply the input value by the corresponding weight and accumulate it in the output.
-            output[i] += (input[j] * this->weights[j * this->output_size + i]);
+            output[i] += (input[j] * weights[j * this->output_size + i]);
         }
     }
 }
 
 void Layer::backward(std::vector<float> &input, std::vector<float> &output_grad, std::vector<float> &input_grad, float lr)
 {
+    this->make_owned();
+
     // Loop over each output node (neuron) of the layer
     for (int i = 0; i < this->output_size; i++)
     {
@@ -55,7 +100,11 @@ void Layer::backward(std::vector<float> &input, std::vector<float> &output_grad,
 
             // Update the weight by subtracting the product of the learning rate and the gradient.
             // w_ij = w_ij - lr * grad
-            this->weights[idx] -= lr * grad;
+            // Pruned connections (mask == 0) are left at zero so that fine-tuning does not grow them back.
+            if (this->mask.empty() || this->mask[idx])
+            {
+                this->weights[idx] -= lr * grad;
+            }
 
             // If input_grad is not empty, compute the gradient of the loss with respect to the input j.
             // This is done by summing up the gradient of the loss with respect to each output i
@@ -73,3 +122,97 @@ void Layer::backward(std::vector<float> &input, std::vector<float> &output_grad,
         this->biases[i] -= lr * output_grad[i];
     }
 }
+
+void Layer::accumulate_gradients(std::vector<float> &input, std::vector<float> &output_grad, std::vector<float> &input_grad,
+                                 float *weight_grad, float *bias_grad)
+{
+    const float *weights = this->weight_data();
+
+    for (int i = 0; i < this->output_size; i++)
+    {
+        for (int j = 0; j < this->input_size; j++)
+        {
+            int idx = j * this->output_size + i;
+
+            // ∂L/∂w_ij = output_grad[i] * input[j], summed over the samples of the batch.
+            weight_grad[idx] += output_grad[i] * input[j];
+
+            // input_grad[j] += ∂L/∂o_i * w_ij (the weights are not modified until the whole batch is done).
+            if (input_grad.size() != 0)
+            {
+                input_grad[j] += output_grad[i] * weights[idx];
+            }
+        }
+
+        // ∂L/∂b_i = output_grad[i]
+        bias_grad[i] += output_grad[i];
+    }
+}
+
+void Layer::apply_gradients(const float *weight_grad, const float *bias_grad, float lr)
+{
+    this->make_owned();
+
+    int n = this->input_size * this->output_size;
+    for (int idx = 0; idx < n; idx++)
+    {
+        if (this->mask.empty() || this->mask[idx])
+        {
+            this->weights[idx] -= lr * weight_grad[idx];
+        }
+    }
+
+    for (int i = 0; i < this->output_size; i++)
+    {
+        this->biases[i] -= lr * bias_grad[i];
+    }
+}
+
+void Layer::prune(float sparsity)
+{
+    int n = this->input_size * this->output_size;
+    int nPruned = (int)(sparsity * n);
+    if (nPruned <= 0)
+        return;
+    if (nPruned >= n)
+        nPruned = n - 1;
+
+    this->make_owned();
+
+    // Find the magnitude threshold: the nPruned-th smallest absolute weight.
+    std::vector<float> magnitudes(n);
+    for (int i = 0; i < n; i++)
+    {
+        magnitudes[i] = fabsf(this->weights[i]);
+    }
+    std::nth_element(magnitudes.begin(), magnitudes.begin() + nPruned, magnitudes.end());
+    float threshold = magnitudes[nPruned];
+
+    if (this->mask.empty())
+    {
+        this->mask = std::vector<unsigned char>(n, 1);
+    }
+
+    // Zero every weight below the threshold and remember it in the mask.
+    for (int i = 0; i < n; i++)
+    {
+        if (fabsf(this->weights[i]) < threshold)
+        {
+            this->weights[i] = 0.f;
+            this->mask[i] = 0;
+        }
+    }
+}
+
+float Layer::sparsity()
+{
+    int n = this->input_size * this->output_size;
+    const float *weights = this->weight_data();
+    int zeros = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (weights[i] == 0.f)
+            zeros++;
+    }
+    return (float)zeros / n;
+}
@@ -1,13 +1,28 @@
+#include <chrono>
+#include <memory>
 #include "network.hpp"
+#include "sweep.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MNIST_FRESH_PROCESS
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #define TRAIN_IMG_PATH "../../data/train-images.idx3-ubyte"
 #define TRAIN_LBL_PATH "../../data/train-labels.idx1-ubyte"
 #define MODEL_PATH "../../trained_network.bin"
+#define SPARSE_MODEL_PATH "../../trained_network_sparse.bin"
+#define ACTIVATION_CACHE_PATH "../../hidden_activations.cache"
 
 #define LEARNING_RATE 0.001f
 #define EPOCHS 20
 #define BATCH_SIZE 64
 #define TRAIN_SPLIT 0.8
+#define FINE_TUNE_EPOCHS 1
+#define DATA_PARALLEL_EPOCHS 2
+#define HEAD_EPOCHS 5
 
 void saveAndLoadNetworkExample(sf::RenderWindow &window)
 {
@@ -29,6 +44,397 @@ void saveAndLoadNetworkExample(sf::RenderWindow &window)
     inputData.display_image_from_data(window, 9, net.predict(img));
 }
 
+// Prunes the trained network to increasing sparsity levels, fine-tunes it and prints accuracy, model size
+// and latency of the dense and sparse inference paths for each level.
+// The CSR kernel also skips black pixels, which speeds it up even without pruning: the "CSR all inputs" column walks
+// every stored weight, so that the dense -> "CSR all inputs" -> "CSR" columns separate the gains of weight sparsity and
+// input sparsity. The dense model size is the same at every level, it is the reference for the CSR file size.
+void pruningCurveExample()
+{
+    InputData inputData;
+    inputData.readData(TRAIN_IMG_PATH, TRAIN_LBL_PATH);
+
+    int trainSize = inputData.nImages * TRAIN_SPLIT;
+    int testSize = inputData.nImages - trainSize;
+
+    // Normalized test images, stored one after the other so they can be fed to the batched kernel.
+    std::vector<float> testImages(testSize * INPUT_SIZE);
+    for (int i = 0; i < testSize * INPUT_SIZE; i++)
+    {
+        testImages[i] = inputData.images[trainSize * INPUT_SIZE + i] / 255.0f;
+    }
+
+    const float sparsities[] = {0.f, 0.5f, 0.7f, 0.8f, 0.9f, 0.95f, 0.98f};
+    std::ostringstream table;
+    table << "Sparsity | Dense size (KB) | CSR size (KB) | Dense (us/img) | CSR all inputs (us/img) | CSR (us/img) | CSR batch (us/img) | Acc pruned | Acc fine-tuned\n";
+
+    for (float sparsity : sparsities)
+    {
+        Network net;
+        net.load_network(MODEL_PATH);
+        net.prune(sparsity);
+
+        float accPruned = net.evaluate(inputData, trainSize, inputData.nImages, true);
+        if (sparsity > 0)
+        {
+            net.trainNetwork(inputData, LEARNING_RATE, TRAIN_SPLIT, FINE_TUNE_EPOCHS, BATCH_SIZE);
+        }
+        float accTuned = net.evaluate(inputData, trainSize, inputData.nImages, true);
+        size_t size = net.save_sparse_network(SPARSE_MODEL_PATH);
+        size_t denseSize = net.parameter_count() * sizeof(float); // Size of the file written by save_network.
+
+        // Time one pass over the test set with each inference path.
+        std::vector<float> img(INPUT_SIZE), batch;
+        std::vector<int> predictions;
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < testSize; i++)
+        {
+            std::copy(testImages.begin() + i * INPUT_SIZE, testImages.begin() + (i + 1) * INPUT_SIZE, img.begin());
+            net.predict(img);
+        }
+        auto dense = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < testSize; i++)
+        {
+            std::copy(testImages.begin() + i * INPUT_SIZE, testImages.begin() + (i + 1) * INPUT_SIZE, img.begin());
+            net.predict_sparse(img, false);
+        }
+        auto sparseAllInputs = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < testSize; i++)
+        {
+            std::copy(testImages.begin() + i * INPUT_SIZE, testImages.begin() + (i + 1) * INPUT_SIZE, img.begin());
+            net.predict_sparse(img);
+        }
+        auto sparse = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < testSize; i += BATCH_SIZE)
+        {
+            int n = std::min(BATCH_SIZE, testSize - i);
+            batch.assign(testImages.begin() + i * INPUT_SIZE, testImages.begin() + (i + n) * INPUT_SIZE);
+            net.predict_sparse_batch(batch, n, predictions);
+        }
+        auto sparseBatch = std::chrono::steady_clock::now() - start;
+
+        char line[256];
+        snprintf(line, sizeof(line), "%7.0f%% | %15.1f | %13.1f | %14.2f | %23.2f | %12.2f | %18.2f | %9.2f%% | %13.2f%%\n",
+                 sparsity * 100, denseSize / 1024.0, size / 1024.0,
+                 std::chrono::duration<double, std::micro>(dense).count() / testSize,
+                 std::chrono::duration<double, std::micro>(sparseAllInputs).count() / testSize,
+                 std::chrono::duration<double, std::micro>(sparse).count() / testSize,
+                 std::chrono::duration<double, std::micro>(sparseBatch).count() / testSize,
+                 accPruned * 100, accTuned * 100);
+        table << line;
+    }
+
+    std::cout << "=> Pruning curve:\n"
+              << table.str();
+}
+
+// Trains every configuration of a hyperparameter sweep concurrently on the dataset, loaded once, and prints a summary.
+// `spec` lists the values to try, e.g. "lr=0.001,0.01 hidden=128,256 epochs=5 threads=4" (see `SweepSpec`).
+void sweepExample(const std::string &spec)
+{
+    SweepSpec sweep;
+    try
+    {
+        sweep = SweepSpec::parse(spec, {LEARNING_RATE, BATCH_SIZE, HIDDEN_SIZE, EPOCHS});
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    InputData inputData;
+    inputData.readData(TRAIN_IMG_PATH, TRAIN_LBL_PATH);
+
+    SweepRunner runner(inputData, TRAIN_SPLIT, sweep.threads, sweep.pin_threads, sweep.stop_margin, sweep.seed);
+    double wallSeconds, sequentialSeconds = -1;
+    std::vector<SweepResult> results = runner.run(sweep.configurations(), &wallSeconds);
+
+    // The same sweep on a single thread, to measure the actual speedup.
+    if (sweep.baseline)
+    {
+        SweepRunner sequential(inputData, TRAIN_SPLIT, 1, sweep.pin_threads, sweep.stop_margin, sweep.seed);
+        sequential.run(sweep.configurations(), &sequentialSeconds);
+    }
+
+    SweepRunner::print_summary(results, wallSeconds, sequentialSeconds, std::cout);
+}
+
+// Loads the network from the file or from the executable, then runs one prediction, and returns the time of each step
+// in microseconds. The network is created before the timer starts, and the console output of the load is discarded.
+void firstPrediction(bool embedded, double &loadUs, double &predictUs)
+{
+    std::vector<float> img(INPUT_SIZE, 0.f);
+    Network net;
+
+    std::streambuf *console = std::cout.rdbuf(nullptr);
+    auto start = std::chrono::steady_clock::now();
+    if (embedded)
+        net.load_embedded_network();
+    else
+        net.load_network(MODEL_PATH);
+    auto loaded = std::chrono::steady_clock::now();
+    net.predict(img);
+    auto predicted = std::chrono::steady_clock::now();
+    std::cout.rdbuf(console);
+    std::cout.clear();
+
+    loadUs = std::chrono::duration<double, std::micro>(loaded - start).count();
+    predictUs = std::chrono::duration<double, std::micro>(predicted - loaded).count();
+}
+
+#ifdef MNIST_FRESH_PROCESS
+// Drops a file from the page cache (best effort: pages mapped by a running process stay), to measure a cold start.
+static void evictFromPageCache(const char *path)
+{
+#ifdef __linux__
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+// Runs `exe --first-prediction file|embedded` in a new process and reads back the times it measured. `totalUs` is the
+// time from fork() to the exit of the process: loading the executable and its libraries, the load and the prediction.
+static bool timeFreshProcess(const char *exe, bool embedded, double &totalUs, double &loadUs, double &predictUs)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    fflush(stdout);
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(exe, exe, "--first-prediction", embedded ? "embedded" : "file", (char *)nullptr);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    std::string output;
+    char buffer[256];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        output.append(buffer, n);
+    }
+    close(fds[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return false;
+    totalUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && sscanf(output.c_str(), "%lf %lf", &loadUs, &predictUs) == 2;
+}
+#endif
+
+// Compares the time needed to get a first prediction with `load_network` (file I/O) and with `load_embedded_network`.
+// Every measurement is a fresh process, so nothing is reused from a previous load. Cold runs first drop the model file and
+// the executable (which holds the embedded weights) from the page cache; warm runs follow a run that loaded them.
+// The embedded weights are only paged in when the first prediction reads them, so the process total is the fair comparison.
+void startupLatencyExample(const char *argv0)
+{
+#ifdef MNIST_FRESH_PROCESS
+    const int repeats = 10;
+#ifdef __linux__
+    const char *exe = "/proc/self/exe";
+    (void)argv0;
+#else
+    const char *exe = argv0;
+#endif
+
+    auto median = [](std::vector<double> values)
+    {
+        std::sort(values.begin(), values.end());
+        return values[values.size() / 2];
+    };
+
+    printf("=> Time to first prediction in a fresh process, median of %d runs:\n", repeats);
+    printf("   Source   | Cache | Process total (us) | Load (us) | First prediction (us)\n");
+    for (bool embedded : {false, true})
+    {
+        if (embedded && !Network::has_embedded_network())
+        {
+            printf("   embedded | not available, configure with -DMNIST_EMBED_MODEL=ON\n");
+            continue;
+        }
+
+        // The cold runs go first: the last one leaves everything in the page cache for the warm runs.
+        for (bool cold : {true, false})
+        {
+            std::vector<double> total, load, predict;
+            for (int r = 0; r < repeats; r++)
+            {
+                double totalUs, loadUs, predictUs;
+                if (cold)
+                {
+                    evictFromPageCache(MODEL_PATH);
+                    evictFromPageCache(exe);
+                }
+
+                if (!timeFreshProcess(exe, embedded, totalUs, loadUs, predictUs))
+                {
+                    std::cerr << "Error running " << exe << " --first-prediction" << std::endl;
+                    exit(1);
+                }
+                total.push_back(totalUs);
+                load.push_back(loadUs);
+                predict.push_back(predictUs);
+            }
+            printf("   %-8s | %-5s | %18.1f | %9.1f | %21.1f\n", embedded ? "embedded" : "file", cold ? "cold" : "warm",
+                   median(total), median(load), median(predict));
+        }
+    }
+#ifndef __linux__
+    printf("=> Page cache eviction is only implemented on Linux, the cold runs are warm here.\n");
+#endif
+#else
+    // Without fork/exec, fall back to timing the first load of this process.
+    (void)argv0;
+    double loadUs, predictUs;
+    firstPrediction(false, loadUs, predictUs);
+    printf("=> load_network: %.1f us, first prediction: %.1f us\n", loadUs, predictUs);
+    if (Network::has_embedded_network())
+    {
+        firstPrediction(true, loadUs, predictUs);
+        printf("=> load_embedded_network: %.1f us, first prediction: %.1f us\n", loadUs, predictUs);
+    }
+#endif
+}
+
+// Trains a single-rank baseline, then the same network with `ranks` data-parallel ranks (processes exchanging gradients
+// through POSIX shared memory, or threads of this process when `useThreads` is set), and prints the scaling efficiency.
+void dataParallelExample(int ranks, bool useThreads)
+{
+    InputData inputData;
+    inputData.readData(TRAIN_IMG_PATH, TRAIN_LBL_PATH);
+
+    bool processes = !useThreads && SharedRegion::processes_supported();
+    if (!useThreads && !processes)
+        std::cout << "=> Multi-process training is not supported on this platform, using threads." << std::endl;
+    if (ranks > BATCH_SIZE)
+        printf("=> Warning: more ranks than samples per batch (%d), every rank uses 1 sample per step and the global batch grows to %d.\n",
+               BATCH_SIZE, ranks);
+
+    // Both runs start from the same weights.
+    Network reference;
+    std::vector<float> initial;
+    reference.get_parameters(initial);
+    int count = reference.parameter_count();
+
+    struct RunStats
+    {
+        double train_seconds, comm_share;
+        bool identical;
+    };
+
+    auto train = [&](int n)
+    {
+        // Creating the POSIX shared memory can still fail at run time (e.g. /dev/shm missing or full in a container).
+        std::unique_ptr<SharedRegion> shared;
+        try
+        {
+            shared.reset(new SharedRegion(RingAllReduce::segment_size(n, count), processes));
+        }
+        catch (const std::runtime_error &e)
+        {
+            std::cout << "=> " << e.what() << ", using threads." << std::endl;
+            processes = false;
+            shared.reset(new SharedRegion(RingAllReduce::segment_size(n, count), processes));
+        }
+        SharedRegion &region = *shared;
+        RingAllReduce::init_segment(region.data(), n, count);
+
+        bool ok = run_ranks(n, processes, region.data(), [&](int rank)
+                            {
+                                // The seeded constructor does not use the global rand(), which the ranks would race on as
+                                // threads. The initial weights are replaced by `initial` anyway.
+                                RingAllReduce comm(region.data(), rank, n, count);
+                                Network net(HIDDEN_SIZE, rank);
+                                net.set_parameters(initial);
+                                net.trainDataParallel(inputData, LEARNING_RATE, TRAIN_SPLIT, DATA_PARALLEL_EPOCHS, BATCH_SIZE, comm); });
+        if (!ok)
+        {
+            std::cerr << "A training process failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        // The slowest rank determines the training time.
+        RingAllReduce comm(region.data(), 0, n, count);
+        RunStats stats = {0, 0, true};
+        for (int r = 0; r < n; r++)
+        {
+            RankReport &report = comm.report(r);
+            stats.train_seconds = std::max(stats.train_seconds, report.train_seconds);
+            stats.comm_share += report.train_seconds > 0 ? report.comm_seconds / report.train_seconds / n : 0;
+            stats.identical = stats.identical && report.checksum == comm.report(0).checksum;
+        }
+        return stats;
+    };
+
+    RunStats baseline = train(1);
+    RunStats parallel = train(ranks);
+
+    double speedup = parallel.train_seconds > 0 ? baseline.train_seconds / parallel.train_seconds : 0;
+    printf("=> Data-parallel training with %d %s:\n", ranks, processes ? "process(es)" : "thread(s)");
+    printf("   - Training time: %.2f s (1 rank: %.2f s)\n", parallel.train_seconds, baseline.train_seconds);
+    printf("   - Speedup: %.2fx, scaling efficiency: %.1f%%\n", speedup, speedup / ranks * 100);
+    printf("   - Communication share: %.1f%% (1 rank: %.1f%%)\n", parallel.comm_share * 100, baseline.comm_share * 100);
+    printf("   - Weights bit-identical across ranks: %s\n", parallel.identical ? "yes" : "NO");
+}
+
+// Fine-tunes only the output layer of the trained network from the cached hidden activations, and compares the epoch
+// time with a full training epoch. With `resetHead`, the output layer is re-initialized first (e.g. for a new label set).
+void trainHeadExample(bool resetHead)
+{
+    InputData inputData;
+    inputData.readData(TRAIN_IMG_PATH, TRAIN_LBL_PATH);
+
+    Network net;
+    net.load_network(MODEL_PATH);
+    if (resetHead)
+        net.reset_output_layer();
+
+    // Reference: one full training epoch on a scratch copy of the network.
+    int trainSize = inputData.nImages * TRAIN_SPLIT;
+    Network full;
+    full.load_network(MODEL_PATH);
+    auto start = std::chrono::steady_clock::now();
+    full.trainEpoch(inputData, LEARNING_RATE, trainSize, BATCH_SIZE);
+    double fullEpoch = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // The dataset is hashed once, and the first call builds the cache if needed: only the epochs are timed.
+    uint64_t datasetHash = ActivationCache::dataset_hash(inputData.images);
+    net.trainHead(inputData, ACTIVATION_CACHE_PATH, LEARNING_RATE, TRAIN_SPLIT, 0, BATCH_SIZE, datasetHash);
+    start = std::chrono::steady_clock::now();
+    net.trainHead(inputData, ACTIVATION_CACHE_PATH, LEARNING_RATE, TRAIN_SPLIT, HEAD_EPOCHS, BATCH_SIZE, datasetHash);
+    double headEpoch = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / HEAD_EPOCHS;
+
+    printf("=> Epoch time: full network %.3f s, output layer from cache %.3f s (%.1fx faster)\n",
+           fullEpoch, headEpoch, headEpoch > 0 ? fullEpoch / headEpoch : 0.0);
+}
+
 std::vector<float> normalizeImage(const std::vector<unsigned char> &images, int imageIndex)
 {
     std::vector<float> float_image(IMAGE_SIZE * IMAGE_SIZE);
@@ -80,19 +486,74 @@ void applyBrush(int xIndex, int yIndex, std::vector<sf::RectangleShape> &pixels)
     }
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && std::string(argv[1]) == "--prune-curve")
+    {
+        pruningCurveExample();
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--bench-startup")
+    {
+        startupLatencyExample(argv[0]);
+        return 0;
+    }
+
+    // Child process of --bench-startup: prints the load and first prediction times in microseconds.
+    if (argc > 2 && std::string(argv[1]) == "--first-prediction")
+    {
+        double loadUs, predictUs;
+        firstPrediction(std::string(argv[2]) == "embedded", loadUs, predictUs);
+        printf("%.1f %.1f\n", loadUs, predictUs);
+        return 0;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--data-parallel")
+    {
+        int ranks = atoi(argv[2]);
+        if (ranks < 1 || ranks > ALLREDUCE_MAX_RANKS)
+        {
+            std::cerr << "The number of ranks must be between 1 and " << ALLREDUCE_MAX_RANKS << std::endl;
+            return 1;
+        }
+        dataParallelExample(ranks, argc > 3 && std::string(argv[3]) == "--threads");
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--train-head")
+    {
+        trainHeadExample(argc > 2 && std::string(argv[2]) == "--reset");
+        return 0;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--sweep")
+    {
+        sweepExample(argv[2]);
+        return 0;
+    }
+
+    // Use the network compiled into the executable when there is one, it does not depend on the working directory.
+    // The dataset is then optional, it is only used to show its first image.
+    bool embedded = Network::has_embedded_network();
+    bool haveData = !embedded || (std::ifstream(TRAIN_IMG_PATH).good() && std::ifstream(TRAIN_LBL_PATH).good());
+
     InputData inputData;
-    inputData.readData(TRAIN_IMG_PATH, TRAIN_LBL_PATH);
+    if (haveData)
+        inputData.readData(TRAIN_IMG_PATH, TRAIN_LBL_PATH);
 
     Network net;
-    net.load_network(MODEL_PATH);
+    if (embedded)
+        net.load_embedded_network();
+    else
+        net.load_network(MODEL_PATH);
 
     sf::RenderWindow window(sf::VideoMode(canvasSize, canvasSize), "Canvas Window");
     sf::RenderWindow renderWindow(sf::VideoMode(canvasSize, canvasSize), "Image Window");
 
     // Display the first dataset image using your display_image function
-    inputData.display_image(renderWindow, normalizeImage(inputData.images, 0));
+    if (haveData)
+        inputData.display_image(renderWindow, normalizeImage(inputData.images, 0));
 
     // 28x28 grid to simulate the MNIST image
     std::vector<sf::RectangleShape> pixels(28 * 28);
@@ -1,4 +1,10 @@
 #include "network.hpp"
+#include "hash.hpp"
+#include <chrono>
+
+#ifdef MNIST_EMBEDDED_MODEL
+#include "embedded_model.hpp"
+#endif
 
 void Network::softmax(std::vector<float> &input, int size)
 {
@@ -15,16 +21,28 @@ void Network::softmax(std::vector<float> &input, int size)
         input[i] /= sum;
 }
 
-Network::Network()
+Network::Network(int hiddenSize)
 {
-    this->hidden = new Layer(INPUT_SIZE, HIDDEN_SIZE);
-    this->output = new Layer(HIDDEN_SIZE, OUTPUT_SIZE);
+    this->hidden_size = hiddenSize;
+    this->hidden = new Layer(INPUT_SIZE, this->hidden_size);
+    this->output = new Layer(this->hidden_size, OUTPUT_SIZE);
+    this->sparse_hidden = nullptr;
+}
+
+Network::Network(int hiddenSize, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    this->hidden_size = hiddenSize;
+    this->hidden = new Layer(INPUT_SIZE, this->hidden_size, rng);
+    this->output = new Layer(this->hidden_size, OUTPUT_SIZE, rng);
+    this->sparse_hidden = nullptr;
 }
 
 Network::~Network()
 {
-    free(this->hidden);
-    free(this->output);
+    delete this->hidden;
+    delete this->output;
+    delete this->sparse_hidden;
 }
 
 void Network::save_network(std::string filename)
@@ -38,12 +56,12 @@ void Network::save_network(std::string filename)
     }
 
     // Save hidden layer weights and biases
-    file.write(reinterpret_cast<char *>(this->hidden->weights.data()), this->hidden->weights.size() * sizeof(float));
-    file.write(reinterpret_cast<char *>(this->hidden->biases.data()), this->hidden->biases.size() * sizeof(float));
+    file.write(reinterpret_cast<const char *>(this->hidden->weight_data()), INPUT_SIZE * this->hidden_size * sizeof(float));
+    file.write(reinterpret_cast<const char *>(this->hidden->bias_data()), this->hidden_size * sizeof(float));
 
     // Save output layer weights and biases
-    file.write(reinterpret_cast<char *>(this->output->weights.data()), this->output->weights.size() * sizeof(float));
-    file.write(reinterpret_cast<char *>(this->output->biases.data()), this->output->biases.size() * sizeof(float));
+    file.write(reinterpret_cast<const char *>(this->output->weight_data()), this->hidden_size * OUTPUT_SIZE * sizeof(float));
+    file.write(reinterpret_cast<const char *>(this->output->bias_data()), OUTPUT_SIZE * sizeof(float));
 
     file.close();
     std::cout << "=> Network saved at : " << filename << std::endl;
@@ -60,9 +78,10 @@ void Network::load_network(std::string filename)
         exit(1);
     }
 
-    // Initialize the hidden and output layers (ensure memory allocation)
-    this->hidden = new Layer(INPUT_SIZE, HIDDEN_SIZE);
-    this->output = new Layer(HIDDEN_SIZE, OUTPUT_SIZE);
+    // Read into the existing layers. They must own their parameters, and the loaded weights are not pruned.
+    this->hidden->make_owned();
+    this->output->make_owned();
+    this->hidden->mask.clear();
 
     // Load hidden layer weights and biases
     file.read(reinterpret_cast<char *>(this->hidden->weights.data()), this->hidden->weights.size() * sizeof(float));
@@ -73,20 +92,145 @@ void Network::load_network(std::string filename)
     file.read(reinterpret_cast<char *>(this->output->biases.data()), this->output->biases.size() * sizeof(float));
 
     file.close();
+
+    // Any compiled sparse layer refers to the previous weights.
+    delete this->sparse_hidden;
+    this->sparse_hidden = nullptr;
+
     std::cout << "=> Network loaded from : " << filename << std::endl;
 }
 
+bool Network::has_embedded_network()
+{
+#ifdef MNIST_EMBEDDED_MODEL
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Network::load_embedded_network()
+{
+#ifdef MNIST_EMBEDDED_MODEL
+    static_assert(embedded_model::input_size == INPUT_SIZE, "Embedded network has a different input size");
+    static_assert(embedded_model::output_size == OUTPUT_SIZE, "Embedded network has a different output size");
+
+    // The weights are constant arrays in the read-only data of the executable. The layers read them in place, so that
+    // nothing is copied and every process running the executable shares the same pages; they are only copied if the
+    // network is trained or pruned afterwards.
+    delete this->hidden;
+    delete this->output;
+    this->hidden_size = embedded_model::hidden_size;
+    this->hidden = new Layer(INPUT_SIZE, this->hidden_size, embedded_model::hidden_weights, embedded_model::hidden_biases);
+    this->output = new Layer(this->hidden_size, OUTPUT_SIZE, embedded_model::output_weights, embedded_model::output_biases);
+
+    delete this->sparse_hidden;
+    this->sparse_hidden = nullptr;
+#else
+    std::cerr << "No network embedded in this executable, configure with -DMNIST_EMBED_MODEL=ON" << std::endl;
+    exit(1);
+#endif
+}
+
+void Network::prune(float sparsity)
+{
+    this->hidden->prune(sparsity);
+
+    delete this->sparse_hidden;
+    this->sparse_hidden = nullptr;
+}
+
+void Network::compile_sparse()
+{
+    delete this->sparse_hidden;
+    this->sparse_hidden = new SparseLayer(*this->hidden);
+}
+
+size_t Network::save_sparse_network(std::string filename)
+{
+    std::cout << "=> Saving Sparse Network...." << std::endl;
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr << "Error opening file to save network: " << filename << std::endl;
+        exit(1);
+    }
+
+    // Always export the current weights.
+    this->compile_sparse();
+
+    // Save the hidden layer in CSR format
+    this->sparse_hidden->save(file);
+
+    // Save output layer weights and biases (dense, it is tiny)
+    file.write(reinterpret_cast<const char *>(this->output->weight_data()), this->hidden_size * OUTPUT_SIZE * sizeof(float));
+    file.write(reinterpret_cast<const char *>(this->output->bias_data()), OUTPUT_SIZE * sizeof(float));
+
+    size_t size = (size_t)file.tellp();
+    file.close();
+    std::cout << "=> Sparse network saved at : " << filename << " (" << size << " bytes)" << std::endl;
+    return size;
+}
+
+void Network::load_sparse_network(std::string filename)
+{
+    std::cout << "=> Loading Sparse Network...." << std::endl;
+
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr << "Error opening file to load network: " << filename << std::endl;
+        exit(1);
+    }
+
+    delete this->sparse_hidden;
+    this->sparse_hidden = new SparseLayer();
+    if (!this->sparse_hidden->load(file, INPUT_SIZE, this->hidden_size))
+    {
+        std::cerr << "Invalid or corrupt sparse network: " << filename << std::endl;
+        exit(1);
+    }
+
+    // Rebuild the dense hidden layer, with the mask set so that fine-tuning keeps the pruned weights at zero.
+    SparseLayer &sparse = *this->sparse_hidden;
+    this->hidden->make_owned();
+    this->hidden->weights.assign(INPUT_SIZE * this->hidden_size, 0.f);
+    this->hidden->mask.assign(INPUT_SIZE * this->hidden_size, 0);
+    this->hidden->biases = sparse.biases;
+    for (int j = 0; j < INPUT_SIZE; j++)
+    {
+        for (int k = sparse.row_ptr[j]; k < sparse.row_ptr[j + 1]; k++)
+        {
+            this->hidden->weights[j * this->hidden_size + sparse.col_idx[k]] = sparse.values[k];
+            this->hidden->mask[j * this->hidden_size + sparse.col_idx[k]] = 1;
+        }
+    }
+
+    // Load output layer weights and biases
+    this->output->make_owned();
+    file.read(reinterpret_cast<char *>(this->output->weights.data()), this->output->weights.size() * sizeof(float));
+    file.read(reinterpret_cast<char *>(this->output->biases.data()), this->output->biases.size() * sizeof(float));
+    if (!file)
+    {
+        std::cerr << "Truncated sparse network: " << filename << std::endl;
+        exit(1);
+    }
+
+    file.close();
+    std::cout << "=> Sparse network loaded from : " << filename << std::endl;
+}
+
 int Network::predict(std::vector<float> &input)
 {
     // Arrays to store the intermediate hidden layer output and the final output (probabilities).
-    std::vector<float> hidden_output(HIDDEN_SIZE), final_output(OUTPUT_SIZE);
+    std::vector<float> hidden_output(this->hidden_size), final_output(OUTPUT_SIZE);
 
     // Forward pass through the hidden layer.
     this->hidden->forward(input, hidden_output);
 
     // Apply the ReLU activation function to the hidden layer's output.
     // ReLU sets all negative values to 0, keeping positive values unchanged.
-    for (int i = 0; i < HIDDEN_SIZE; i++)
+    for (int i = 0; i < this->hidden_size; i++)
     {
         hidden_output[i] = hidden_output[i] > 0 ? hidden_output[i] : 0;
     }
@@ -112,20 +256,89 @@ int Network::predict(std::vector<float> &input)
     return max_index;
 }
 
+int Network::predictFromHidden(std::vector<float> &hidden_output)
+{
+    std::vector<float> final_output(OUTPUT_SIZE);
+
+    // ReLU activation on the hidden layer's output.
+    for (int i = 0; i < this->hidden_size; i++)
+    {
+        hidden_output[i] = hidden_output[i] > 0 ? hidden_output[i] : 0;
+    }
+
+    this->output->forward(hidden_output, final_output);
+    softmax(final_output, OUTPUT_SIZE);
+
+    int max_index = 0;
+    for (int i = 1; i < OUTPUT_SIZE; i++)
+    {
+        if (final_output[i] > final_output[max_index])
+        {
+            max_index = i;
+        }
+    }
+    return max_index;
+}
+
+int Network::predict_sparse(std::vector<float> &input, bool skipZeroInputs)
+{
+    if (this->sparse_hidden == nullptr)
+        this->compile_sparse();
+
+    std::vector<float> hidden_output(this->hidden_size);
+    this->sparse_hidden->forward(input, hidden_output, skipZeroInputs);
+    return this->predictFromHidden(hidden_output);
+}
+
+void Network::predict_sparse_batch(const std::vector<float> &inputs, int batchSize, std::vector<int> &predictions)
+{
+    if (this->sparse_hidden == nullptr)
+        this->compile_sparse();
+
+    std::vector<float> hidden_outputs(batchSize * this->hidden_size), hidden_output(this->hidden_size);
+    this->sparse_hidden->forward_batch(inputs, hidden_outputs, batchSize);
+
+    predictions.resize(batchSize);
+    for (int s = 0; s < batchSize; s++)
+    {
+        std::copy(hidden_outputs.begin() + s * this->hidden_size, hidden_outputs.begin() + (s + 1) * this->hidden_size, hidden_output.begin());
+        predictions[s] = this->predictFromHidden(hidden_output);
+    }
+}
+
+float Network::evaluate(InputData &data, int begin, int end, bool sparse)
+{
+    std::vector<float> img(INPUT_SIZE);
+    int correct = 0;
+    for (int i = begin; i < end; i++)
+    {
+        // Normalize the input image.
+        for (int k = 0; k < INPUT_SIZE; k++)
+        {
+            img[k] = data.images[i * INPUT_SIZE + k] / 255.0f;
+        }
+
+        int prediction = sparse ? this->predict_sparse(img) : this->predict(img);
+        if (prediction == data.labels[i])
+            correct++;
+    }
+    return end > begin ? (float)correct / (end - begin) : 0.f;
+}
+
 void Network::trainSingle(std::vector<float> &input, int label, float lr)
 {
     // Arrays to store intermediate values and gradients
-    std::vector<float> hidden_output(HIDDEN_SIZE);
+    std::vector<float> hidden_output(this->hidden_size);
     std::vector<float> final_output(OUTPUT_SIZE);
     std::vector<float> output_grad(OUTPUT_SIZE, 0);
-    std::vector<float> hidden_grad(HIDDEN_SIZE, 0);
+    std::vector<float> hidden_grad(this->hidden_size, 0);
 
     // Forward Pass: Input to Hidden Layer
     this->hidden->forward(input, hidden_output);
 
     // Apply ReLU activation function on the hidden layer output
     // ReLU (Rectified Linear Unit) sets any negative value to 0, keeping positive values unchanged.
-    for (int i = 0; i < HIDDEN_SIZE; i++)
+    for (int i = 0; i < this->hidden_size; i++)
     {
         hidden_output[i] = hidden_output[i] > 0 ? hidden_output[i] : 0; // ReLU Activation
     }
@@ -149,7 +362,7 @@ void Network::trainSingle(std::vector<float> &input, int label, float lr)
     // Backpropagate Through ReLU Activation:
     // Only propagate the gradient for neurons where ReLU was active (output > 0).
     // The gradient is 0 for inputs where ReLU "deactivated" the neuron (output <= 0).
-    for (int i = 0; i < HIDDEN_SIZE; i++)
+    for (int i = 0; i < this->hidden_size; i++)
     {
         hidden_grad[i] *= hidden_output[i] > 0 ? 1 : 0; // Derivative of ReLU
     }
@@ -161,83 +374,389 @@ void Network::trainSingle(std::vector<float> &input, int label, float lr)
     this->hidden->backward(input, hidden_grad, nullOutputGrad, lr);
 }
 
+float Network::accumulateSingle(std::vector<float> &input, int label, std::vector<float> &grad)
+{
+    std::vector<float> hidden_output(this->hidden_size);
+    std::vector<float> final_output(OUTPUT_SIZE);
+    std::vector<float> output_grad(OUTPUT_SIZE, 0);
+    std::vector<float> hidden_grad(this->hidden_size, 0);
+
+    // Same forward pass as trainSingle
+    this->hidden->forward(input, hidden_output);
+    for (int i = 0; i < this->hidden_size; i++)
+    {
+        hidden_output[i] = hidden_output[i] > 0 ? hidden_output[i] : 0; // ReLU Activation
+    }
+    this->output->forward(hidden_output, final_output);
+    softmax(final_output, OUTPUT_SIZE);
+
+    for (int i = 0; i < OUTPUT_SIZE; i++)
+        output_grad[i] = final_output[i] - (i == label); // Softmax-CrossEntropy gradient
+
+    // Gradients are laid out like the parameters: hidden weights, hidden biases, output weights, output biases.
+    float *hidden_weight_grad = grad.data();
+    float *hidden_bias_grad = hidden_weight_grad + INPUT_SIZE * this->hidden_size;
+    float *output_weight_grad = hidden_bias_grad + this->hidden_size;
+    float *output_bias_grad = output_weight_grad + this->hidden_size * OUTPUT_SIZE;
+
+    this->output->accumulate_gradients(hidden_output, output_grad, hidden_grad, output_weight_grad, output_bias_grad);
+
+    for (int i = 0; i < this->hidden_size; i++)
+    {
+        hidden_grad[i] *= hidden_output[i] > 0 ? 1 : 0; // Derivative of ReLU
+    }
+
+    std::vector<float> nullOutputGrad;
+    this->hidden->accumulate_gradients(input, hidden_grad, nullOutputGrad, hidden_weight_grad, hidden_bias_grad);
+
+    return -logf(final_output[label] + 1e-10f);
+}
+
+float Network::trainEpoch(InputData &data, float learning_rate, int trainSize, int batchSize)
+{
+    // The dataset is only read, so several networks can train on the same `InputData` concurrently.
+    const std::vector<unsigned char> &images = data.images, &labels = data.labels;
+
+    // The weights are about to change, so any compiled sparse layer becomes stale.
+    delete this->sparse_hidden;
+    this->sparse_hidden = nullptr;
+
+    std::vector<float> img(INPUT_SIZE); // buffer for normalized image
+    float total_loss = 0;               // Variable to track total loss over the epoch.
+
+    // Iterate over the training data in batches.
+    for (int i = 0; i < trainSize; i += batchSize)
+    {
+        for (int j = 0; j < batchSize && i + j < trainSize; j++)
+        {
+            int idx = i + j; // Current data index.
+
+            // Normalize the input image (convert pixel values from 0-255 to 0-1).
+            for (int k = 0; k < INPUT_SIZE; k++)
+            {
+                img[k] = images[idx * INPUT_SIZE + k] / 255.0f;
+            }
+
+            // Train the network with the current image and its label.
+            this->trainSingle(img, labels[idx], learning_rate);
+
+            // Compute the loss for this batch (optional for tracking).
+            std::vector<float> hidden_output(this->hidden_size), final_output(OUTPUT_SIZE);
+            this->hidden->forward(img, hidden_output);
+
+            // Apply ReLU activation to the hidden layer's output.
+            for (int k = 0; k < this->hidden_size; k++)
+            {
+                hidden_output[k] = hidden_output[k] > 0 ? hidden_output[k] : 0; // ReLU Activation
+            }
+
+            // Forward pass from hidden layer to output layer.
+            this->output->forward(hidden_output, final_output);
+            this->softmax(final_output, OUTPUT_SIZE);
+
+            // Calculate the loss using the negative log-likelihood of the true label.
+            total_loss += -logf(final_output[labels[idx]] + 1e-10f); // Avoid log(0) by adding a small epsilon.
+        }
+    }
+
+    return trainSize > 0 ? total_loss / trainSize : 0.f;
+}
+
 void Network::trainNetwork(InputData &data,
                            float learning_rate,
                            float trainSplit,
                            int epochs,
                            int batchSize)
 {
-    // Loading Data to feed the network
     int nImages = data.nImages;
-    int nLabels = data.nLabels;
-    std::vector<unsigned char> images = data.images, labels = data.labels;
 
     printf("=> Starting training with %d epoch(s).\n", epochs);
 
-    std::vector<float> img(INPUT_SIZE); // buffer for normalized image
-
-    // Calculate the number of training and test examples.
+    // Calculate the number of training examples, the rest of the dataset is used for testing.
     int train_size = (nImages * trainSplit);
-    int test_size = nImages - train_size;
 
     // Training loop that iterates through multiple epochs.
     for (int epoch = 0; epoch < epochs; epoch++)
     {
-        float total_loss = 0; // Variable to track total loss over the epoch.
+        float avg_loss = this->trainEpoch(data, learning_rate, train_size, batchSize);
 
-        // Iterate over the training data in batches.
-        for (int i = 0; i < train_size; i += batchSize)
+        // Testing phase: Evaluate accuracy on the test set.
+        float accuracy = this->evaluate(data, train_size, nImages);
+
+        // Print the epoch results: accuracy and average loss.
+        printf("   - Epoch %d, Accuracy: %.2f%%, Avg Loss: %.4f\n", epoch + 1, accuracy * 100, avg_loss);
+    }
+}
+
+int Network::parameter_count()
+{
+    return INPUT_SIZE * this->hidden_size + this->hidden_size + this->hidden_size * OUTPUT_SIZE + OUTPUT_SIZE;
+}
+
+void Network::get_parameters(std::vector<float> &parameters)
+{
+    parameters.clear();
+    parameters.reserve(this->parameter_count());
+    for (Layer *layer : {this->hidden, this->output})
+    {
+        const float *weights = layer->weight_data(), *biases = layer->bias_data();
+        parameters.insert(parameters.end(), weights, weights + layer->input_size * layer->output_size);
+        parameters.insert(parameters.end(), biases, biases + layer->output_size);
+    }
+}
+
+void Network::set_parameters(const std::vector<float> &parameters)
+{
+    this->hidden->make_owned();
+    this->output->make_owned();
+
+    auto it = parameters.begin();
+    for (std::vector<float> *values : {&this->hidden->weights, &this->hidden->biases, &this->output->weights, &this->output->biases})
+    {
+        std::copy(it, it + values->size(), values->begin());
+        it += values->size();
+    }
+
+    delete this->sparse_hidden;
+    this->sparse_hidden = nullptr;
+}
+
+uint64_t Network::checksum()
+{
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+    for (Layer *layer : {this->hidden, this->output})
+    {
+        hash = fnv1a_hash(layer->weight_data(), layer->input_size * layer->output_size * sizeof(float), hash);
+        hash = fnv1a_hash(layer->bias_data(), layer->output_size * sizeof(float), hash);
+    }
+    return hash;
+}
+
+void Network::trainDataParallel(InputData &data,
+                                float learning_rate,
+                                float trainSplit,
+                                int epochs,
+                                int batchSize,
+                                RingAllReduce &comm)
+{
+    int rank = comm.get_rank(), ranks = comm.get_ranks();
+    const std::vector<unsigned char> &images = data.images, &labels = data.labels;
+
+    // Contiguous shard of the training set for this rank. All the shards have the same size so that every rank runs the
+    // same number of steps; the last (train_size % ranks) training images are left out.
+    int train_size = (data.nImages * trainSplit);
+    int shard_size = train_size / ranks;
+    int shard_begin = rank * shard_size;
+    int local_batch = std::max(1, batchSize / ranks);
+
+    if (rank == 0)
+        printf("=> Starting data-parallel training with %d rank(s), %d epoch(s).\n", ranks, epochs);
+
+    // Start from the same weights on every rank.
+    std::vector<float> parameters;
+    this->get_parameters(parameters);
+    comm.broadcast(parameters, 0);
+    this->set_parameters(parameters);
+
+    int nParameters = this->parameter_count();
+    std::vector<float> grad(nParameters), loss(1);
+    std::vector<float> img(INPUT_SIZE);
+    float *hidden_weight_grad = grad.data();
+    float *hidden_bias_grad = hidden_weight_grad + INPUT_SIZE * this->hidden_size;
+    float *output_weight_grad = hidden_bias_grad + this->hidden_size;
+    float *output_bias_grad = output_weight_grad + this->hidden_size * OUTPUT_SIZE;
+
+    RankReport &report = comm.report(rank);
+    report.train_seconds = 0;
+    report.comm_seconds = 0;
+
+    for (int epoch = 0; epoch < epochs; epoch++)
+    {
+        loss[0] = 0;
+        auto epoch_start = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < shard_size; i += local_batch)
         {
-            for (int j = 0; j < batchSize && i + j < train_size; j++)
+            std::fill(grad.begin(), grad.end(), 0.f);
+            for (int j = 0; j < local_batch && i + j < shard_size; j++)
             {
-                int idx = i + j; // Current data index.
-
-                // Normalize the input image (convert pixel values from 0-255 to 0-1).
+                int idx = shard_begin + i + j;
                 for (int k = 0; k < INPUT_SIZE; k++)
                 {
                     img[k] = images[idx * INPUT_SIZE + k] / 255.0f;
                 }
+                loss[0] += this->accumulateSingle(img, labels[idx], grad);
+            }
 
-                // Train the network with the current image and its label.
-                this->trainSingle(img, labels[idx], learning_rate);
+            // Sum the gradients of the global batch over all the ranks.
+            auto comm_start = std::chrono::steady_clock::now();
+            comm.all_reduce(grad);
+            report.comm_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - comm_start).count();
 
-                // Compute the loss for this batch (optional for tracking).
-                std::vector<float> hidden_output(HIDDEN_SIZE), final_output(OUTPUT_SIZE);
-                this->hidden->forward(img, hidden_output);
+            this->hidden->apply_gradients(hidden_weight_grad, hidden_bias_grad, learning_rate);
+            this->output->apply_gradients(output_weight_grad, output_bias_grad, learning_rate);
+        }
 
-                // Apply ReLU activation to the hidden layer's output.
-                for (int k = 0; k < HIDDEN_SIZE; k++)
-                {
-                    hidden_output[k] = hidden_output[k] > 0 ? hidden_output[k] : 0; // ReLU Activation
-                }
+        report.train_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch_start).count();
 
-                // Forward pass from hidden layer to output layer.
-                this->output->forward(hidden_output, final_output);
-                this->softmax(final_output, OUTPUT_SIZE);
+        // Total loss over all the shards.
+        comm.all_reduce(loss);
 
-                // Calculate the loss using the negative log-likelihood of the true label.
-                total_loss += -logf(final_output[labels[idx]] + 1e-10f); // Avoid log(0) by adding a small epsilon.
-            }
+        if (rank == 0)
+        {
+            float accuracy = this->evaluate(data, train_size, data.nImages);
+            // The loss is computed with the gradients, before the step. Computing it after the step like trainEpoch would
+            // cost a second forward pass per sample, so it is labelled differently instead.
+            printf("   - Epoch %d, Accuracy: %.2f%%, Avg Loss (before step): %.4f\n", epoch + 1, accuracy * 100, loss[0] / (shard_size * ranks));
         }
 
-        // Testing phase: Evaluate accuracy on the test set.
-        int correct = 0; // Track the number of correct predictions.
-        for (int i = train_size; i < nImages; i++)
+        // The other ranks wait for the evaluation here, outside of the timed part, instead of in the first all-reduce of
+        // the next epoch.
+        comm.barrier();
+    }
+
+    delete this->sparse_hidden;
+    this->sparse_hidden = nullptr;
+    report.checksum = this->checksum();
+}
+
+uint64_t Network::hidden_checksum()
+{
+    uint64_t hash = fnv1a_hash(this->hidden->weight_data(), INPUT_SIZE * this->hidden_size * sizeof(float));
+    return fnv1a_hash(this->hidden->bias_data(), this->hidden_size * sizeof(float), hash);
+}
+
+void Network::reset_output_layer()
+{
+    delete this->output;
+    this->output = new Layer(this->hidden_size, OUTPUT_SIZE);
+}
+
+void Network::build_activation_cache(InputData &data, std::string cacheFile, uint64_t datasetHash)
+{
+    std::cout << "=> Building activation cache...." << std::endl;
+
+    std::vector<float> activations((size_t)data.nImages * this->hidden_size);
+    std::vector<float> img(INPUT_SIZE), hidden_output(this->hidden_size);
+    for (int i = 0; i < data.nImages; i++)
+    {
+        for (int k = 0; k < INPUT_SIZE; k++)
         {
-            // Normalize the input image.
-            for (int k = 0; k < INPUT_SIZE; k++)
-            {
-                img[k] = images[i * INPUT_SIZE + k] / 255.0f;
-            }
+            img[k] = data.images[i * INPUT_SIZE + k] / 255.0f;
+        }
+
+        this->hidden->forward(img, hidden_output);
+        for (int k = 0; k < this->hidden_size; k++)
+        {
+            activations[(size_t)i * this->hidden_size + k] = hidden_output[k] > 0 ? hidden_output[k] : 0; // ReLU Activation
+        }
+    }
+
+    ActivationCacheHeader header;
+    header.hidden_size = this->hidden_size;
+    header.n_images = data.nImages;
+    header.weights_hash = this->hidden_checksum();
+    header.dataset_hash = datasetHash;
+
+    try
+    {
+        ActivationCache::write(cacheFile, header, activations);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+    std::cout << "=> Activation cache saved at : " << cacheFile << std::endl;
+}
+
+void Network::trainHead(InputData &data,
+                        std::string cacheFile,
+                        float learning_rate,
+                        float trainSplit,
+                        int epochs,
+                        int batchSize,
+                        uint64_t datasetHash)
+{
+    int nImages = data.nImages;
+    const std::vector<unsigned char> &labels = data.labels;
 
-            // Predict the label for the current test image.
-            if (this->predict(img) == labels[i])
+    uint64_t weightsHash = this->hidden_checksum();
+
+    ActivationCache cache;
+    if (!cache.open(cacheFile, this->hidden_size, nImages, weightsHash, datasetHash))
+    {
+        std::cout << "=> Activation cache missing or stale: " << cacheFile << std::endl;
+        this->build_activation_cache(data, cacheFile, datasetHash);
+        if (!cache.open(cacheFile, this->hidden_size, nImages, weightsHash, datasetHash))
+        {
+            std::cerr << "Error opening activation cache: " << cacheFile << std::endl;
+            exit(1);
+        }
+    }
+
+    printf("=> Starting output layer training with %d epoch(s), hidden layer frozen.\n", epochs);
+
+    int train_size = (nImages * trainSplit);
+    int test_size = nImages - train_size;
+
+    std::vector<float> hidden_output(this->hidden_size), final_output(OUTPUT_SIZE), output_grad(OUTPUT_SIZE);
+    std::vector<float> nullInputGrad; // The hidden layer is frozen, no gradient flows into it.
+
+    // The cache holds bfloat16 activations, and the rounding can flip close predictions. The test split is evaluated on
+    // full precision activations instead, computed once since the hidden layer does not change, so that the printed
+    // accuracy is exactly the one `predict` gets.
+    std::vector<float> test_activations(epochs > 0 ? (size_t)test_size * this->hidden_size : 0);
+    std::vector<float> img(INPUT_SIZE);
+    for (int i = 0; epochs > 0 && i < test_size; i++)
+    {
+        for (int k = 0; k < INPUT_SIZE; k++)
+        {
+            img[k] = data.images[(size_t)(train_size + i) * INPUT_SIZE + k] / 255.0f;
+        }
+        this->hidden->forward(img, hidden_output);
+        std::copy(hidden_output.begin(), hidden_output.end(), test_activations.begin() + (size_t)i * this->hidden_size);
+    }
+
+    for (int epoch = 0; epoch < epochs; epoch++)
+    {
+        float total_loss = 0;
+
+        for (int i = 0; i < train_size; i += batchSize)
+        {
+            for (int j = 0; j < batchSize && i + j < train_size; j++)
             {
-                correct++; // Increment correct count if the prediction matches the label.
+                int idx = i + j;
+
+                // The post-ReLU hidden activations come straight from the cache.
+                cache.get(idx, hidden_output);
+                this->output->forward(hidden_output, final_output);
+                softmax(final_output, OUTPUT_SIZE);
+
+                for (int k = 0; k < OUTPUT_SIZE; k++)
+                    output_grad[k] = final_output[k] - (k == labels[idx]); // Softmax-CrossEntropy gradient
+
+                this->output->backward(hidden_output, output_grad, nullInputGrad, learning_rate);
+
+                // Loss after the update, like trainEpoch.
+                this->output->forward(hidden_output, final_output);
+                softmax(final_output, OUTPUT_SIZE);
+                total_loss += -logf(final_output[labels[idx]] + 1e-10f);
             }
         }
 
-        // Print the epoch results: accuracy and average loss.
-        printf("   - Epoch %d, Accuracy: %.2f%%, Avg Loss: %.4f\n", epoch + 1, (float)correct / test_size * 100, total_loss / train_size);
+        // Testing phase, through the same output layer prediction as predict and predict_sparse.
+        int correct = 0;
+        for (int i = 0; i < test_size; i++)
+        {
+            std::copy(test_activations.begin() + (size_t)i * this->hidden_size,
+                      test_activations.begin() + (size_t)(i + 1) * this->hidden_size, hidden_output.begin());
+            if (this->predictFromHidden(hidden_output) == labels[train_size + i])
+                correct++;
+        }
+        float accuracy = test_size > 0 ? (float)correct / test_size : 0.f;
+        float avg_loss = train_size > 0 ? total_loss / train_size : 0.f;
+
+        printf("   - Epoch %d, Accuracy: %.2f%%, Avg Loss: %.4f\n", epoch + 1, accuracy * 100, avg_loss);
     }
 }
@@ -0,0 +1,159 @@
+#include "sparse_layer.hpp"
+
+SparseLayer::SparseLayer()
+{
+    this->input_size = 0;
+    this->output_size = 0;
+}
+
+SparseLayer::SparseLayer(const Layer &layer)
+{
+    if (layer.output_size > UINT16_MAX + 1)
+    {
+        throw std::runtime_error("SparseLayer: output size too large for 16 bit column indices");
+    }
+
+    this->input_size = layer.input_size;
+    this->output_size = layer.output_size;
+    this->biases.assign(layer.bias_data(), layer.bias_data() + layer.output_size);
+    this->row_ptr = std::vector<int>(layer.input_size + 1, 0);
+
+    const float *weights = layer.weight_data();
+
+    // Walk the dense weights row by row (one row per input) and keep only the non-zero entries.
+    for (int j = 0; j < layer.input_size; j++)
+    {
+        for (int i = 0; i < layer.output_size; i++)
+        {
+            float w = weights[j * layer.output_size + i];
+            if (w != 0.f)
+            {
+                this->col_idx.push_back((uint16_t)i);
+                this->values.push_back(w);
+            }
+        }
+        this->row_ptr[j + 1] = (int)this->values.size();
+    }
+}
+
+void SparseLayer::forward(std::vector<float> &input, std::vector<float> &output, bool skipZeroInputs)
+{
+    // Start from the biases, then scatter the contribution of every non-zero input.
+    for (int i = 0; i < this->output_size; i++)
+    {
+        output[i] = this->biases[i];
+    }
+
+    for (int j = 0; j < this->input_size; j++)
+    {
+        float x = input[j];
+
+        // A zero input contributes nothing, whatever the weights of its row are.
+        if (skipZeroInputs && x == 0.f)
+            continue;
+
+        for (int k = this->row_ptr[j]; k < this->row_ptr[j + 1]; k++)
+        {
+            output[this->col_idx[k]] += x * this->values[k];
+        }
+    }
+}
+
+void SparseLayer::forward_batch(const std::vector<float> &inputs, std::vector<float> &outputs, int batchSize)
+{
+    for (int s = 0; s < batchSize; s++)
+    {
+        for (int i = 0; i < this->output_size; i++)
+        {
+            outputs[s * this->output_size + i] = this->biases[i];
+        }
+    }
+
+    // Rows are the outer loop so that each row of weights is read from memory once and reused for the whole batch.
+    for (int j = 0; j < this->input_size; j++)
+    {
+        int begin = this->row_ptr[j], end = this->row_ptr[j + 1];
+        if (begin == end)
+            continue;
+
+        for (int s = 0; s < batchSize; s++)
+        {
+            float x = inputs[s * this->input_size + j];
+            if (x == 0.f)
+                continue;
+
+            float *out = &outputs[s * this->output_size];
+            for (int k = begin; k < end; k++)
+            {
+                out[this->col_idx[k]] += x * this->values[k];
+            }
+        }
+    }
+}
+
+int SparseLayer::nnz()
+{
+    return (int)this->values.size();
+}
+
+size_t SparseLayer::size_in_bytes()
+{
+    return 3 * sizeof(int) +
+           this->row_ptr.size() * sizeof(int) +
+           this->col_idx.size() * sizeof(uint16_t) +
+           this->values.size() * sizeof(float) +
+           this->biases.size() * sizeof(float);
+}
+
+void SparseLayer::save(std::ofstream &file)
+{
+    int nnz = this->nnz();
+    file.write(reinterpret_cast<char *>(&this->input_size), sizeof(int));
+    file.write(reinterpret_cast<char *>(&this->output_size), sizeof(int));
+    file.write(reinterpret_cast<char *>(&nnz), sizeof(int));
+
+    file.write(reinterpret_cast<char *>(this->row_ptr.data()), this->row_ptr.size() * sizeof(int));
+    file.write(reinterpret_cast<char *>(this->col_idx.data()), this->col_idx.size() * sizeof(uint16_t));
+    file.write(reinterpret_cast<char *>(this->values.data()), this->values.size() * sizeof(float));
+    file.write(reinterpret_cast<char *>(this->biases.data()), this->biases.size() * sizeof(float));
+}
+
+bool SparseLayer::load(std::ifstream &file, int in_size, int out_size)
+{
+    int nnz;
+    file.read(reinterpret_cast<char *>(&this->input_size), sizeof(int));
+    file.read(reinterpret_cast<char *>(&this->output_size), sizeof(int));
+    file.read(reinterpret_cast<char *>(&nnz), sizeof(int));
+
+    // Check the sizes before allocating anything from them.
+    if (!file || this->input_size != in_size || this->output_size != out_size ||
+        nnz < 0 || (long long)nnz > (long long)in_size * out_size)
+        return false;
+
+    this->row_ptr.resize(this->input_size + 1);
+    this->col_idx.resize(nnz);
+    this->values.resize(nnz);
+    this->biases.resize(this->output_size);
+
+    file.read(reinterpret_cast<char *>(this->row_ptr.data()), this->row_ptr.size() * sizeof(int));
+    file.read(reinterpret_cast<char *>(this->col_idx.data()), this->col_idx.size() * sizeof(uint16_t));
+    file.read(reinterpret_cast<char *>(this->values.data()), this->values.size() * sizeof(float));
+    file.read(reinterpret_cast<char *>(this->biases.data()), this->biases.size() * sizeof(float));
+    if (!file)
+        return false;
+
+    // row_ptr must start at 0, never decrease and end at nnz, and every column must be a valid output.
+    if (this->row_ptr[0] != 0 || this->row_ptr[this->input_size] != nnz)
+        return false;
+    for (int j = 0; j < this->input_size; j++)
+    {
+        if (this->row_ptr[j + 1] < this->row_ptr[j])
+            return false;
+    }
+    for (uint16_t col : this->col_idx)
+    {
+        if (col >= this->output_size)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,374 @@
+#include "sweep.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+SweepSpec::SweepSpec()
+{
+    this->lr_min = 0.f;
+    this->lr_max = 0.f;
+    this->random_samples = 0;
+    this->seed = 1;
+    this->threads = 0;
+    this->pin_threads = true;
+    this->baseline = false;
+    this->stop_margin = 0.f;
+}
+
+// Splits "a,b,c" into {"a", "b", "c"}.
+static std::vector<std::string> split(const std::string &str, char delimiter)
+{
+    std::vector<std::string> parts;
+    std::istringstream stream(str);
+    std::string part;
+    while (std::getline(stream, part, delimiter))
+    {
+        if (!part.empty())
+            parts.push_back(part);
+    }
+    return parts;
+}
+
+static float parseFloat(const std::string &key, const std::string &value)
+{
+    try
+    {
+        return std::stof(value);
+    }
+    catch (const std::exception &)
+    {
+        throw std::runtime_error("Invalid value for sweep parameter '" + key + "': " + value);
+    }
+}
+
+static int parseInt(const std::string &key, const std::string &value)
+{
+    int result;
+    try
+    {
+        result = std::stoi(value);
+    }
+    catch (const std::exception &)
+    {
+        throw std::runtime_error("Invalid value for sweep parameter '" + key + "': " + value);
+    }
+    if (result < 0)
+        throw std::runtime_error("Negative value for sweep parameter '" + key + "': " + value);
+    return result;
+}
+
+SweepSpec SweepSpec::parse(const std::string &spec, const SweepConfig &defaults)
+{
+    SweepSpec result;
+
+    // Entries are separated by spaces or ';'.
+    std::string entries = spec;
+    std::replace(entries.begin(), entries.end(), ';', ' ');
+
+    for (const std::string &entry : split(entries, ' '))
+    {
+        size_t eq = entry.find('=');
+        if (eq == std::string::npos)
+            throw std::runtime_error("Invalid sweep entry (expected key=value): " + entry);
+
+        std::string key = entry.substr(0, eq);
+        std::vector<std::string> values = split(entry.substr(eq + 1), ',');
+        if (values.empty())
+            throw std::runtime_error("Missing value for sweep parameter '" + key + "'");
+
+        if (key == "lr")
+        {
+            for (const std::string &value : values)
+            {
+                size_t colon = value.find(':');
+                if (colon == std::string::npos)
+                {
+                    result.learning_rates.push_back(parseFloat(key, value));
+                }
+                else
+                {
+                    result.lr_min = parseFloat(key, value.substr(0, colon));
+                    result.lr_max = parseFloat(key, value.substr(colon + 1));
+                    if (result.lr_min <= 0 || result.lr_max < result.lr_min)
+                        throw std::runtime_error("Invalid learning rate range: " + value);
+                }
+            }
+        }
+        else if (key == "batch" || key == "hidden" || key == "epochs")
+        {
+            std::vector<int> &target = key == "batch" ? result.batch_sizes : key == "hidden" ? result.hidden_sizes : result.epochs;
+            for (const std::string &value : values)
+            {
+                int n = parseInt(key, value);
+                if (n == 0)
+                    throw std::runtime_error("Sweep parameter '" + key + "' must be positive");
+                target.push_back(n);
+            }
+        }
+        else if (key == "random")
+            result.random_samples = parseInt(key, values[0]);
+        else if (key == "seed")
+            result.seed = (unsigned)parseInt(key, values[0]);
+        else if (key == "threads")
+            result.threads = parseInt(key, values[0]);
+        else if (key == "pin")
+            result.pin_threads = parseInt(key, values[0]) != 0;
+        else if (key == "baseline")
+            result.baseline = parseInt(key, values[0]) != 0;
+        else if (key == "stop")
+            result.stop_margin = parseFloat(key, values[0]);
+        else
+            throw std::runtime_error("Unknown sweep parameter: " + key);
+    }
+
+    if (result.lr_max > 0 && result.random_samples == 0)
+        throw std::runtime_error("Learning rate ranges are only supported with random=N");
+
+    // Hyperparameters that are not part of the sweep keep their default value.
+    if (result.learning_rates.empty() && result.lr_max == 0)
+        result.learning_rates.push_back(defaults.learning_rate);
+    if (result.batch_sizes.empty())
+        result.batch_sizes.push_back(defaults.batch_size);
+    if (result.hidden_sizes.empty())
+        result.hidden_sizes.push_back(defaults.hidden_size);
+    if (result.epochs.empty())
+        result.epochs.push_back(defaults.epochs);
+
+    return result;
+}
+
+std::vector<SweepConfig> SweepSpec::configurations()
+{
+    std::vector<SweepConfig> configs;
+
+    if (this->random_samples > 0)
+    {
+        std::mt19937 rng(this->seed);
+        auto pick = [&rng](const auto &values)
+        {
+            return values[std::uniform_int_distribution<size_t>(0, values.size() - 1)(rng)];
+        };
+
+        for (int n = 0; n < this->random_samples; n++)
+        {
+            SweepConfig config;
+            if (this->lr_max > 0)
+            {
+                // Log-uniform: every decade of the range is equally likely.
+                float u = std::uniform_real_distribution<float>(logf(this->lr_min), logf(this->lr_max))(rng);
+                config.learning_rate = expf(u);
+            }
+            else
+            {
+                config.learning_rate = pick(this->learning_rates);
+            }
+            config.batch_size = pick(this->batch_sizes);
+            config.hidden_size = pick(this->hidden_sizes);
+            config.epochs = pick(this->epochs);
+            configs.push_back(config);
+        }
+        return configs;
+    }
+
+    // Full grid: the cartesian product of all the values.
+    for (float lr : this->learning_rates)
+        for (int batch : this->batch_sizes)
+            for (int hidden : this->hidden_sizes)
+                for (int epochs : this->epochs)
+                    configs.push_back({lr, batch, hidden, epochs});
+    return configs;
+}
+
+// The cores this process is allowed to run on (its CPU mask, which cgroups or taskset may restrict).
+static std::vector<int> allowedCores()
+{
+    std::vector<int> cores;
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &cpus) == 0)
+    {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+        {
+            if (CPU_ISSET(c, &cpus))
+                cores.push_back(c);
+        }
+    }
+#endif
+    if (cores.empty())
+    {
+        for (unsigned c = 0; c < std::max(1u, std::thread::hardware_concurrency()); c++)
+            cores.push_back((int)c);
+    }
+    return cores;
+}
+
+// Pins the calling thread to a single core. Only implemented on Linux, elsewhere it does nothing and reports success.
+static bool pinCurrentThread(int core)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) == 0;
+#else
+    (void)core;
+    return true;
+#endif
+}
+
+SweepRunner::SweepRunner(InputData &data, float trainSplit, int threads, bool pinThreads, float stopMargin, unsigned seed)
+    : data(data)
+{
+    this->trainSplit = trainSplit;
+    this->threads = threads > 0 ? threads : (int)allowedCores().size();
+    this->pinThreads = pinThreads;
+    this->stopMargin = stopMargin;
+    this->seed = seed;
+}
+
+std::vector<SweepResult> SweepRunner::run(const std::vector<SweepConfig> &configs, double *wallSeconds)
+{
+    std::vector<SweepResult> results(configs.size());
+    std::vector<std::unique_ptr<Network>> nets(configs.size());
+    int nImages = this->data.nImages;
+    int trainSize = nImages * this->trainSplit;
+
+    // Runs that still have epochs to train.
+    std::vector<size_t> active;
+    for (size_t c = 0; c < configs.size(); c++)
+    {
+        results[c].config = configs[c];
+        results[c].loss = 0.f;
+        results[c].seconds = 0;
+        results[c].stopped_early = false;
+        active.push_back(c);
+    }
+
+    std::vector<int> cores = allowedCores();
+    std::mutex outputMutex;
+    printf("=> Starting sweep of %d configuration(s) on %d thread(s).\n", (int)configs.size(),
+           std::min(this->threads, (int)configs.size()));
+
+    // The runs advance one epoch per round, and are only compared once all of them finished the epoch (synchronous
+    // successive halving). Which runs are terminated early therefore only depends on the accuracies, not on the thread
+    // count or on the order in which the threads happen to finish.
+    auto start = std::chrono::steady_clock::now();
+    for (int epoch = 0; !active.empty(); epoch++)
+    {
+        // Workers pull the index of the next active run to train from a shared counter.
+        std::atomic<size_t> next(0);
+        int nWorkers = std::min(this->threads, (int)active.size());
+
+        auto worker = [&](int workerIndex)
+        {
+            int core = cores[workerIndex % cores.size()];
+            if (this->pinThreads && !pinCurrentThread(core) && epoch == 0)
+            {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                std::cerr << "=> Could not pin sweep worker " << workerIndex << " to core " << core << std::endl;
+            }
+
+            for (size_t a = next++; a < active.size(); a = next++)
+            {
+                size_t c = active[a];
+                const SweepConfig &config = configs[c];
+                SweepResult &result = results[c];
+
+                auto runStart = std::chrono::steady_clock::now();
+                if (!nets[c])
+                    nets[c].reset(new Network(config.hidden_size, this->seed));
+                result.loss = nets[c]->trainEpoch(this->data, config.learning_rate, trainSize, config.batch_size);
+                result.accuracy.push_back(nets[c]->evaluate(this->data, trainSize, nImages));
+                result.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count();
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (int w = 0; w < nWorkers; w++)
+        {
+            pool.emplace_back(worker, w);
+        }
+        for (std::thread &thread : pool)
+        {
+            thread.join();
+        }
+
+        // Every active run now has an accuracy for this epoch: compare them all with the best one.
+        float best = 0.f;
+        for (size_t c : active)
+        {
+            best = std::max(best, results[c].accuracy[epoch]);
+        }
+
+        std::vector<size_t> remaining;
+        for (size_t c : active)
+        {
+            SweepResult &result = results[c];
+            if (epoch + 1 >= configs[c].epochs)
+            {
+                nets[c].reset();
+            }
+            else if (this->stopMargin > 0 && result.accuracy[epoch] < best - this->stopMargin)
+            {
+                result.stopped_early = true;
+                nets[c].reset();
+            }
+            else
+            {
+                remaining.push_back(c);
+            }
+        }
+        active = remaining;
+    }
+
+    if (wallSeconds != nullptr)
+        *wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return results;
+}
+
+void SweepRunner::print_summary(std::vector<SweepResult> results, double wallSeconds, double sequentialSeconds, std::ostream &out)
+{
+    std::sort(results.begin(), results.end(), [](const SweepResult &a, const SweepResult &b)
+              {
+                  float accA = a.accuracy.empty() ? 0.f : a.accuracy.back();
+                  float accB = b.accuracy.empty() ? 0.f : b.accuracy.back();
+                  return accA > accB; });
+
+    double runSeconds = 0;
+    char line[256];
+    out << "=> Sweep summary:\n";
+    out << "  Rank | Learning rate | Batch | Hidden | Epochs | Accuracy | Avg Loss | Time (s) | Status\n";
+    for (size_t r = 0; r < results.size(); r++)
+    {
+        const SweepResult &result = results[r];
+        runSeconds += result.seconds;
+        snprintf(line, sizeof(line), "  %4d | %13.6f | %5d | %6d | %3d/%-2d | %7.2f%% | %8.4f | %8.2f | %s\n",
+                 (int)r + 1, result.config.learning_rate, result.config.batch_size, result.config.hidden_size,
+                 (int)result.accuracy.size(), result.config.epochs,
+                 result.accuracy.empty() ? 0.f : result.accuracy.back() * 100, result.loss, result.seconds,
+                 result.stopped_early ? "stopped early" : "done");
+        out << line;
+    }
+
+    // The run times were measured while the runs competed for cores and memory bandwidth, so their sum is not the time a
+    // sequential sweep would take. Only a measured single-thread baseline gives the speedup.
+    snprintf(line, sizeof(line), "=> Wall time: %.2f s (sum of the run times: %.2f s)\n", wallSeconds, runSeconds);
+    out << line;
+    if (sequentialSeconds >= 0)
+    {
+        snprintf(line, sizeof(line), "=> Single-thread baseline: %.2f s, speedup: %.2fx\n",
+                 sequentialSeconds, wallSeconds > 0 ? sequentialSeconds / wallSeconds : 0.0);
+        out << line;
+    }
+}
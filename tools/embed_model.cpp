@@ -0,0 +1,98 @@
+// Build-time tool: converts a network saved with `Network::save_network` into a C++ header holding the weights and
+// biases as `alignas(64) constexpr` arrays, so that the model can be linked into the executable (see MNIST_EMBED_MODEL).
+//
+// Usage: embed_model <trained_network.bin> <embedded_model.hpp>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "layer.hpp"
+
+#define OUTPUT_SIZE 10 // Same as network.hpp
+
+static void writeArray(std::ofstream &out, const char *name, const std::vector<float> &values)
+{
+    out << "alignas(64) constexpr float " << name << "[" << values.size() << "] = {\n";
+    char literal[64];
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        // Hexadecimal float literals round-trip exactly, the embedded weights are bit-identical to the file.
+        snprintf(literal, sizeof(literal), "%af,", values[i]);
+        out << literal << ((i + 1) % 8 == 0 ? "\n" : " ");
+    }
+    out << "};\n\n";
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <trained_network.bin> <embedded_model.hpp>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream file(argv[1], std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+    {
+        std::cerr << "Error opening file to embed network: " << argv[1] << std::endl;
+        return 1;
+    }
+
+    // The file has no header: infer the hidden layer size from the number of floats it holds,
+    // n = INPUT_SIZE * hidden + hidden + hidden * OUTPUT_SIZE + OUTPUT_SIZE.
+    long long size = file.tellg();
+    long long n = size / (long long)sizeof(float);
+    long long hiddenSize = (n - OUTPUT_SIZE) / (INPUT_SIZE + 1 + OUTPUT_SIZE);
+    if (size % sizeof(float) != 0 || hiddenSize <= 0 || hiddenSize * (INPUT_SIZE + 1 + OUTPUT_SIZE) + OUTPUT_SIZE != n)
+    {
+        std::cerr << "Unexpected network file size: " << argv[1] << " (" << size << " bytes)" << std::endl;
+        return 1;
+    }
+
+    std::vector<float> hiddenWeights(INPUT_SIZE * hiddenSize), hiddenBiases(hiddenSize);
+    std::vector<float> outputWeights(hiddenSize * OUTPUT_SIZE), outputBiases(OUTPUT_SIZE);
+
+    // Same order as Network::save_network
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(hiddenWeights.data()), hiddenWeights.size() * sizeof(float));
+    file.read(reinterpret_cast<char *>(hiddenBiases.data()), hiddenBiases.size() * sizeof(float));
+    file.read(reinterpret_cast<char *>(outputWeights.data()), outputWeights.size() * sizeof(float));
+    file.read(reinterpret_cast<char *>(outputBiases.data()), outputBiases.size() * sizeof(float));
+    file.close();
+
+    for (const std::vector<float> *values : {&hiddenWeights, &hiddenBiases, &outputWeights, &outputBiases})
+    {
+        for (float v : *values)
+        {
+            if (!std::isfinite(v))
+            {
+                std::cerr << "Network file contains non-finite weights: " << argv[1] << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    std::ofstream out(argv[2]);
+    if (!out.is_open())
+    {
+        std::cerr << "Error opening file to write embedded network: " << argv[2] << std::endl;
+        return 1;
+    }
+
+    out << "// Generated by embed_model from " << argv[1] << ". Do not edit.\n";
+    out << "#pragma once\n\n";
+    out << "namespace embedded_model\n{\n";
+    out << "constexpr int input_size = " << INPUT_SIZE << ";\n";
+    out << "constexpr int hidden_size = " << hiddenSize << ";\n";
+    out << "constexpr int output_size = " << OUTPUT_SIZE << ";\n\n";
+    writeArray(out, "hidden_weights", hiddenWeights);
+    writeArray(out, "hidden_biases", hiddenBiases);
+    writeArray(out, "output_weights", outputWeights);
+    writeArray(out, "output_biases", outputBiases);
+    out << "}\n";
+    out.close();
+
+    std::cout << "=> Embedded network " << argv[1] << " (hidden size " << hiddenSize << ") into " << argv[2] << std::endl;
+    return 0;
+}